@@ -1,195 +1,2190 @@
 #include <stdio.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/ioctl.h>
+#include <netdb.h>
+#include <poll.h>
 #include <CoreFoundation/CoreFoundation.h>
 #include "MobileDevice.h"
 
+typedef struct {
+    char *bytes;
+    size_t capacity;
+    uint64_t written; // Total bytes ever recorded; the write head is written % capacity
+    CFAbsoluteTime triggerHoldoffUntil; // Triggers matching before this only get reported, so one incident dumps once
+    char deviceId[64];
+} FlightRecorder;
+
 typedef struct {
     service_conn_t connection;
     CFSocketRef socket;
     CFRunLoopSourceRef source;
+    FlightRecorder *recorder;
+    char lastByte; // Last byte of the current record, to decide whether its NUL needs to become a newline
+    size_t recordLength; // Bytes seen so far of a record split across reads
+    char held[2]; // Start of a split record too short to know yet whether it's blank
+    size_t heldLength;
 } DeviceConsoleConnection;
 
+typedef struct {
+    char *processName; // NULL matches records from any process
+    char *text;
+} RecorderTrigger;
+
+typedef enum {
+    LogLevelUnknown,
+    LogLevelDebug,
+    LogLevelInfo,
+    LogLevelNotice,
+    LogLevelWarning,
+    LogLevelError,
+    LogLevelCount
+} LogLevel;
+
+typedef struct {
+    char name[48];
+    size_t nameLength;
+    bool used;
+    double tokens;
+    CFAbsoluteTime refilledAt;
+    unsigned int sampleCredit[LogLevelCount];
+    uint64_t rateLimited;
+    uint64_t sampled;
+} ProcessStats;
+
+typedef struct {
+    char *bytes;
+    size_t length;
+    size_t capacity;
+} OutputBuffer;
+
+typedef enum {
+    FormatFieldLiteral,
+    FormatFieldTime,
+    FormatFieldDevice,
+    FormatFieldProcess,
+    FormatFieldPid,
+    FormatFieldLevel,
+    FormatFieldMessage
+} FormatField;
+
+typedef struct {
+    FormatField field;
+    const char *literal;
+    size_t literalLength;
+    size_t width; // Pad with spaces to at least this many bytes
+    size_t precision; // Truncate to at most this many bytes
+    bool leftAlign;
+} FormatOp;
+
+typedef struct {
+    const char *time;
+    size_t timeLength;
+    const char *device;
+    size_t deviceLength;
+    const char *process;
+    size_t processLength;
+    const char *pid;
+    size_t pidLength;
+    LogLevel level;
+    const char *levelName; // Without the surrounding "<>:"
+    size_t levelNameLength;
+    const char *message; // Excludes the trailing newline
+    size_t messageLength;
+} LogFields;
+
+#define CONTROL_COMMAND_MAX 256
+
+typedef struct {
+    char line[CONTROL_COMMAND_MAX]; // The command read so far, up to its newline
+    size_t length;
+    bool overlong; // The rest of a line too long to be a command is being discarded
+} ControlClient;
+
+typedef struct {
+    uint64_t offset; // Position in the queued stream of the first frame queued at queuedAt
+    CFAbsoluteTime queuedAt;
+} ForwarderMark;
+
+typedef struct {
+    const char *destination; // host:port or a unix socket path
+    bool lineFraming;
+    struct addrinfo *addresses; // Resolved once, then tried in turn
+    struct addrinfo *nextAddress;
+    int fd;
+    bool connecting; // A non-blocking connect on fd hasn't completed yet
+    CFAbsoluteTime connectStartedAt;
+    char *pending; // Framed records not yet written, oldest first
+    size_t pendingStart;
+    size_t pendingLength;
+    size_t pendingCapacity;
+    size_t retryLimit;
+    size_t frameSent; // Bytes of the frame at pendingStart already written
+    uint64_t streamQueued; // Bytes ever taken into the retry buffer or the spill file
+    uint64_t streamConsumed; // Of those, bytes written or given up on after a disconnect
+    ForwarderMark *marks; // When unsent frames were queued, oldest first, so latency covers time spent spilled
+    size_t markStart;
+    size_t markCount;
+    size_t markCapacity;
+    CFAbsoluteTime nextConnectAt;
+    const char *spillPath;
+    int spillFd;
+    off_t spillReadOffset;
+    off_t spillLength;
+    int year;
+    char utcOffset[6];
+    uint64_t queued;
+    uint64_t sent;
+    uint64_t dropped;
+    uint64_t spilled;
+    uint64_t batches;
+    uint64_t bytesSent;
+    size_t maxBatch;
+    double totalLatency;
+    double maxLatency;
+} Forwarder;
+
+typedef struct {
+    unsigned int id;
+    size_t tokenCount;
+    char **tokens; // NULL where the template has a variable
+    size_t *tokenLengths;
+    uint64_t count;
+} LogTemplate;
+
+typedef struct MinerNode MinerNode;
+
+typedef struct {
+    char *key;
+    size_t keyLength;
+    MinerNode *node;
+} MinerChild;
+
+struct MinerNode {
+    MinerChild *children;
+    int childCount;
+    MinerNode *wildcard; // Tokens containing digits and overflow past MINER_MAX_CHILDREN
+    LogTemplate **templates;
+    int templateCount;
+};
+
+#define MINER_MAX_TOKENS 128
+#define MINER_TREE_DEPTH 2
+#define MINER_MAX_CHILDREN 100
+#define MINER_SIMILARITY 0.5
+#define MINER_TOP_COUNT 20
+
+typedef struct {
+    MinerNode *lengthNodes[MINER_MAX_TOKENS + 1];
+    LogTemplate **templates; // Indexed by template id
+    size_t templateCount;
+    int captureFd;
+    OutputBuffer capture;
+} TemplateMiner;
+
+typedef struct {
+    char *bytes;
+    size_t length;
+    size_t capacity;
+} LiveLine;
+
+#define LIVE_HISTORY 512
+
+typedef struct {
+    bool enabled;
+    bool overloaded; // The screen currently shows a redrawn frame with a status bar
+    LiveLine lines[LIVE_HISTORY];
+    size_t next; // Total lines enqueued; the newest is at (next - 1) % LIVE_HISTORY
+    size_t pending; // Lines enqueued since the last frame
+    uint64_t skipped;
+    size_t windowLines;
+    CFAbsoluteTime windowStart;
+    double linesPerSecond;
+    OutputBuffer frame;
+    OutputBuffer rendered; // Lines of an overloaded frame as printed, newest first
+} LiveView;
+
+typedef struct {
+    const char *start;
+    const char *end;
+    OutputBuffer output;
+    bool done;
+} OfflineChunk;
+
+#define OFFLINE_CHUNK_SIZE (4 * 1024 * 1024)
+
+typedef struct {
+    OfflineChunk *chunks;
+    size_t chunkCount;
+    size_t nextChunk; // Next chunk for a worker to claim
+    size_t written; // Chunks already written out, in order
+    size_t window;
+    pthread_mutex_t lock;
+    pthread_cond_t chunkDone;
+    pthread_cond_t chunkWritten;
+} OfflineJob;
+
+enum {
+    OptionFormat = 256,
+    OptionMine,
+    OptionTemplateCapture,
+    OptionTop,
+    OptionLive,
+    OptionFps,
+    OptionTee,
+    OptionInput,
+    OptionJobs,
+    OptionRaw
+};
+
+#define RECORDER_TRIGGER_HOLDOFF 10.0
+#define PASSTHROUGH_BUFFER_SIZE (256 * 1024)
+
+#define PROCESS_TABLE_SIZE 1024
+#define SAMPLE_SCALE 10000
+#define SUPPRESSION_REPORT_INTERVAL 5.0
+#define FORWARD_BATCH_SIZE (64 * 1024)
+#define FORWARD_FLUSH_INTERVAL 0.1
+#define FORWARD_RECONNECT_INTERVAL 1.0
+#define FORWARD_CONNECT_TIMEOUT 5.0
+#define FORWARD_LATENCY_RESOLUTION 0.1
+
 static CFMutableDictionaryRef liveConnections;
 static int debug;
 static CFStringRef requiredDeviceId;
 static char *requiredProcessName;
-static void (*printMessage)(int fd, const char *, size_t);
-static void (*printSeparator)(int fd);
+static size_t recorderCapacity;
+static const char *recorderDirectory = ".";
+static RecorderTrigger *recorderTriggers;
+static int recorderTriggerCount;
+static int signalPipe[2] = { -1, -1 };
+static bool limitingEnabled;
+static double rateLimit;
+static double rateBurst; // A line costs one token, so the bucket holds at least one
+static unsigned int sampleRates[LogLevelCount] = { SAMPLE_SCALE, SAMPLE_SCALE, SAMPLE_SCALE, SAMPLE_SCALE, SAMPLE_SCALE, SAMPLE_SCALE };
+static ProcessStats processTable[PROCESS_TABLE_SIZE];
+static ProcessStats overflowProcess = { .name = "(other)", .nameLength = 7, .used = true };
+static Forwarder forwarder = { .fd = -1, .retryLimit = 8 * 1024 * 1024, .spillFd = -1 };
+static bool miningEnabled;
+static TemplateMiner miner = { .captureFd = -1 };
+static FormatOp *formatOps;
+static int formatOpCount;
+static OutputBuffer stdoutBuffer;
+static LiveView live;
+static int teeFd = -1;
+static bool passthrough;
+static bool rawOutput;
+static OutputBuffer teeBuffer;
+static void (*teeMessage)(OutputBuffer *out, const char *, size_t);
+static void (*printMessage)(OutputBuffer *out, const char *, size_t);
+static void (*printSeparator)(OutputBuffer *out);
+
+static inline void write_fully(int fd, const char *buffer, size_t length)
+{
+    while (length) {
+        ssize_t result = write(fd, buffer, length);
+        if (result == -1)
+            break;
+        buffer += result;
+        length -= result;
+    }
+}
+
+static inline void write_string(int fd, const char *string)
+{
+    write_fully(fd, string, strlen(string));
+}
+
+static void buffer_append(OutputBuffer *out, const char *bytes, size_t length)
+{
+    if (out->length + length > out->capacity) {
+        size_t capacity = out->capacity ? out->capacity : 64 * 1024;
+        while (capacity < out->length + length)
+            capacity *= 2;
+        out->bytes = realloc(out->bytes, capacity);
+        out->capacity = capacity;
+    }
+    memcpy(out->bytes + out->length, bytes, length);
+    out->length += length;
+}
+
+static inline void buffer_append_string(OutputBuffer *out, const char *string)
+{
+    buffer_append(out, string, strlen(string));
+}
+
+static void buffer_flush(OutputBuffer *out, int fd)
+{
+    write_fully(fd, out->bytes, out->length);
+    out->length = 0;
+}
+
+static inline bool next_record(const char **cursor, const char *end, const char **record_out, size_t *recordLength_out)
+{
+    // Records are NUL delimited; skip empty ones
+    const char *record = *cursor;
+    while (record != end && *record == '\0')
+        record++;
+    if (record == end) {
+        *cursor = end;
+        return false;
+    }
+    const char *delimiter = memchr(record, '\0', end - record);
+    if (!delimiter)
+        delimiter = end;
+    *record_out = record;
+    *recordLength_out = delimiter - record;
+    *cursor = delimiter;
+    return true;
+}
+
+static int find_space_offsets(const char *buffer, size_t length, size_t *space_offsets_out)
+{
+    int o = 0;
+    for (size_t i = 16; i < length; i++) {
+        if (buffer[i] == ' ') {
+            space_offsets_out[o++] = i;
+            if (o == 3) {
+                break;
+            }
+        }
+    }
+    return o;
+}
+static size_t get_process_name(const char *buffer, const size_t *space_offsets, const char **name_out)
+{
+    // Process name runs from the first space to the second, minus any [pid] suffix
+    const char *name = buffer + space_offsets[0] + 1;
+    size_t nameLength = space_offsets[1] - space_offsets[0] - 1;
+    if (nameLength > 1) {
+        const char *bracket = memchr(name + 1, '[', nameLength - 1);
+        if (bracket)
+            nameLength = bracket - name;
+    }
+    *name_out = name;
+    return nameLength;
+}
+
+static inline bool process_name_matches(const char *name, size_t nameLength, const char *expected)
+{
+    return strlen(expected) == nameLength && memcmp(name, expected, nameLength) == 0;
+}
+
+static unsigned char should_print_message(const char *buffer, size_t length)
+{
+    if (length < 3) return 0; // don't want blank lines
+    
+    size_t space_offsets[3];
+    int o = find_space_offsets(buffer, length, space_offsets);
+    
+    // Check whether process name matches the one passed to -p option and filter if needed
+    if (requiredProcessName != NULL) {
+        if (o < 2)
+            return 0;
+        const char *processName;
+        size_t nameLength = get_process_name(buffer, space_offsets, &processName);
+        if (!process_name_matches(processName, nameLength, requiredProcessName))
+            return 0;
+    }
+    
+    // More filtering options can be added here and return 0 when they won't meed filter criteria
+    
+    return 1;
+}
+
+static LogLevel get_log_level(const char *buffer, const size_t *space_offsets)
+{
+    // Level sits between the second and third spaces as " <Level>:"
+    const char *level = buffer + space_offsets[1] + 1;
+    size_t levelLength = space_offsets[2] - space_offsets[1] - 1;
+    if (levelLength < 4 || level[0] != '<' || level[levelLength - 2] != '>')
+        return LogLevelUnknown;
+    level++;
+    levelLength -= 3;
+    if (levelLength == 5 && memcmp(level, "Debug", 5) == 0)
+        return LogLevelDebug;
+    if (levelLength == 4 && memcmp(level, "Info", 4) == 0)
+        return LogLevelInfo;
+    if (levelLength == 6 && memcmp(level, "Notice", 6) == 0)
+        return LogLevelNotice;
+    if (levelLength == 7 && memcmp(level, "Warning", 7) == 0)
+        return LogLevelWarning;
+    if ((levelLength == 5 && memcmp(level, "Error", 5) == 0) || (levelLength == 8 && memcmp(level, "Critical", 8) == 0)
+        || (levelLength == 5 && memcmp(level, "Alert", 5) == 0) || (levelLength == 9 && memcmp(level, "Emergency", 9) == 0))
+        return LogLevelError;
+    return LogLevelUnknown;
+}
+
+static void parse_log_fields(const char *buffer, size_t length, LogFields *fields)
+{
+    memset(fields, 0, sizeof *fields);
+    size_t space_offsets[3];
+    if (find_space_offsets(buffer, length, space_offsets) < 3) {
+        fields->message = buffer;
+        fields->messageLength = length;
+    } else {
+        fields->time = buffer;
+        fields->timeLength = 15;
+        fields->device = buffer + 16;
+        fields->deviceLength = space_offsets[0] - 16;
+        fields->processLength = get_process_name(buffer, space_offsets, &fields->process);
+        const char *pidEnd = buffer + space_offsets[1] - 1;
+        const char *pid = fields->process + fields->processLength;
+        if (pid < pidEnd && *pid == '[' && *pidEnd == ']') {
+            fields->pid = pid + 1;
+            fields->pidLength = pidEnd - fields->pid;
+        }
+        fields->level = get_log_level(buffer, space_offsets);
+        fields->levelName = buffer + space_offsets[1] + 1;
+        fields->levelNameLength = space_offsets[2] - space_offsets[1] - 1;
+        if (fields->levelNameLength >= 3 && fields->levelName[0] == '<' && memcmp(fields->levelName + fields->levelNameLength - 2, ">:", 2) == 0) {
+            fields->levelName++;
+            fields->levelNameLength -= 3;
+        }
+        fields->message = buffer + space_offsets[2] + 1;
+        fields->messageLength = length - space_offsets[2] - 1;
+    }
+    if (fields->messageLength && fields->message[fields->messageLength - 1] == '\n')
+        fields->messageLength--;
+}
+
+static ProcessStats *intern_process(const char *name, size_t nameLength)
+{
+    if (nameLength >= sizeof processTable[0].name)
+        nameLength = sizeof processTable[0].name - 1;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < nameLength; i++)
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    for (size_t probe = 0; probe < PROCESS_TABLE_SIZE; probe++) {
+        ProcessStats *process = &processTable[(hash + probe) % PROCESS_TABLE_SIZE];
+        if (!process->used) {
+            process->used = true;
+            memcpy(process->name, name, nameLength);
+            process->name[nameLength] = '\0';
+            process->nameLength = nameLength;
+            process->tokens = rateBurst;
+            process->refilledAt = CFAbsoluteTimeGetCurrent();
+            // Let the first line of every level through so a sampled process never goes silent
+            for (int level = 0; level < LogLevelCount; level++)
+                process->sampleCredit[level] = SAMPLE_SCALE - 1;
+            return process;
+        }
+        if (process->nameLength == nameLength && memcmp(process->name, name, nameLength) == 0)
+            return process;
+    }
+    return &overflowProcess;
+}
+
+static bool admit_message(const char *buffer, size_t length)
+{
+    size_t space_offsets[3];
+    if (find_space_offsets(buffer, length, space_offsets) < 3)
+        return true;
+    LogLevel level = get_log_level(buffer, space_offsets);
+    if (level == LogLevelError)
+        return true; // errors are never sampled or rate limited
+    const char *processName;
+    size_t nameLength = get_process_name(buffer, space_offsets, &processName);
+    ProcessStats *process = intern_process(processName, nameLength);
+    
+    // Level-aware sampling keeps a fixed fraction of lines, deterministically
+    unsigned int sampleRate = sampleRates[level];
+    if (sampleRate < SAMPLE_SCALE) {
+        process->sampleCredit[level] += sampleRate;
+        if (process->sampleCredit[level] < SAMPLE_SCALE) {
+            process->sampled++;
+            return false;
+        }
+        process->sampleCredit[level] -= SAMPLE_SCALE;
+    }
+    // Token bucket per process, refilled at rateLimit lines per second with a burst of one second's worth (at least one line)
+    if (rateLimit > 0) {
+        CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+        process->tokens += (now - process->refilledAt) * rateLimit;
+        process->refilledAt = now;
+        if (process->tokens > rateBurst)
+            process->tokens = rateBurst;
+        if (process->tokens < 1) {
+            process->rateLimited++;
+            return false;
+        }
+        process->tokens -= 1;
+    }
+    return true;
+}
+
+// Live view: on a terminal, records are kept in a small history and drawn at a
+// fixed frame rate. When more lines arrive in a frame than fit on the screen,
+// only the newest screenful is drawn under a status bar counting what was skipped.
+
+static void live_enqueue(const char *buffer, size_t length)
+{
+    LiveLine *line = &live.lines[live.next++ % LIVE_HISTORY];
+    if (line->capacity < length) {
+        line->capacity = length;
+        line->bytes = realloc(line->bytes, length);
+    }
+    memcpy(line->bytes, buffer, length);
+    line->length = length;
+    live.pending++;
+    live.windowLines++;
+}
+
+static size_t count_rows(const char *bytes, size_t length, unsigned short columns, size_t rowLimit, size_t *fitLength)
+{
+    // Rows printed text takes on a terminal columns wide, and how much of it fits in rowLimit rows;
+    // escape sequences, control characters and UTF-8 continuation bytes take no room
+    size_t rows = 0;
+    size_t column = 0;
+    *fitLength = length;
+    for (size_t i = 0; i < length; i++) {
+        unsigned char c = bytes[i];
+        if (c == '\e') {
+            if (i + 1 < length && bytes[i + 1] == '[') {
+                for (i += 2; i < length && !(bytes[i] >= 0x40 && bytes[i] <= 0x7e); i++)
+                    ;
+            }
+            continue;
+        }
+        if (c == '\n') {
+            rows++;
+            column = 0;
+            continue;
+        }
+        if ((c < ' ' && c != '\t') || (c & 0xc0) == 0x80)
+            continue;
+        if (column == columns) {
+            rows++;
+            column = 0;
+        }
+        if (rows == rowLimit && *fitLength == length)
+            *fitLength = i;
+        column = c == '\t' ? (column / 8 + 1) * 8 : column + 1;
+        if (column > columns)
+            column = columns;
+    }
+    return column ? rows + 1 : rows;
+}
+
+static void LiveFrameCallback(CFRunLoopTimerRef timer, void *info)
+{
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    if (now - live.windowStart >= 1.0) {
+        live.linesPerSecond = live.windowLines / (now - live.windowStart);
+        live.windowLines = 0;
+        live.windowStart = now;
+    }
+    if (!live.pending && !live.overloaded)
+        return;
+    
+    unsigned short rows = 24;
+    unsigned short columns = 80;
+    struct winsize size;
+    if (ioctl(1, TIOCGWINSZ, &size) == 0 && size.ws_row > 1 && size.ws_col) {
+        rows = size.ws_row;
+        columns = size.ws_col;
+    }
+    size_t screenLines = rows - 1 < LIVE_HISTORY ? rows - 1 : LIVE_HISTORY;
+    
+    OutputBuffer *frame = &live.frame;
+    if (live.pending <= screenLines) {
+        // Light load: let the terminal scroll as usual, one write per frame
+        if (live.overloaded) {
+            buffer_append_string(frame, "\r\e[K");
+            live.overloaded = false;
+        }
+        for (size_t i = live.next - live.pending; i != live.next; i++) {
+            LiveLine *line = &live.lines[i % LIVE_HISTORY];
+            printMessage(frame, line->bytes, line->length);
+            printSeparator(frame);
+        }
+    } else {
+        // Overloaded: render the newest lines and redraw as many as fit, counting the rows
+        // each takes as printed, separator included
+        OutputBuffer *rendered = &live.rendered;
+        size_t offsets[LIVE_HISTORY + 1];
+        size_t taken = 0;
+        size_t rowsLeft = screenLines;
+        size_t first = live.next;
+        rendered->length = 0;
+        offsets[0] = 0;
+        while (first != live.next - live.pending && live.next - first < LIVE_HISTORY) {
+            const LiveLine *line = &live.lines[(first - 1) % LIVE_HISTORY];
+            size_t start = rendered->length;
+            printMessage(rendered, line->bytes, line->length);
+            printSeparator(rendered);
+            size_t fitLength;
+            size_t lineRows = count_rows(rendered->bytes + start, rendered->length - start, columns, rowsLeft, &fitLength);
+            if (lineRows > rowsLeft) {
+                rendered->length = start;
+                // The newest line is always drawn, cut to what the screen holds
+                if (!taken) {
+                    rendered->length += fitLength;
+                    buffer_append_string(rendered, "\e[m");
+                    offsets[++taken] = rendered->length;
+                    first--;
+                }
+                break;
+            }
+            rowsLeft -= lineRows;
+            offsets[++taken] = rendered->length;
+            first--;
+        }
+        live.skipped += live.pending - (live.next - first);
+        live.overloaded = true;
+        buffer_append_string(frame, "\e[H\e[J");
+        for (size_t i = taken; i; i--)
+            buffer_append(frame, rendered->bytes + offsets[i - 1], offsets[i] - offsets[i - 1]);
+        char status[160];
+        int statusLength = snprintf(status, sizeof status, "\e[%u;1H\e[7m %.0f lines/sec, %llu skipped, showing newest lines \e[K\e[m",
+                                    rows, live.linesPerSecond, (unsigned long long)live.skipped);
+        if (statusLength >= (int)sizeof status)
+            statusLength = sizeof status - 1;
+        buffer_append(frame, status, statusLength);
+    }
+    live.pending = 0;
+    buffer_flush(frame, 1);
+}
+
+static void start_live_view(double framesPerSecond)
+{
+    live.windowStart = CFAbsoluteTimeGetCurrent();
+    CFTimeInterval interval = 1.0 / framesPerSecond;
+    CFRunLoopTimerRef timer = CFRunLoopTimerCreate(kCFAllocatorDefault, live.windowStart + interval, interval, 0, 0, LiveFrameCallback, NULL);
+    CFRunLoopAddTimer(CFRunLoopGetMain(), timer, kCFRunLoopCommonModes);
+    CFRelease(timer);
+}
+
+static void print_record(const char *buffer, size_t length)
+{
+    if (teeFd != -1)
+        teeMessage(&teeBuffer, buffer, length);
+    if (live.enabled) {
+        live_enqueue(buffer, length);
+    } else {
+        printMessage(&stdoutBuffer, buffer, length);
+        printSeparator(&stdoutBuffer);
+    }
+}
+
+static void flush_output(void)
+{
+    buffer_flush(&stdoutBuffer, 1);
+    if (teeFd != -1)
+        buffer_flush(&teeBuffer, teeFd);
+    if (miner.captureFd != -1)
+        buffer_flush(&miner.capture, miner.captureFd);
+}
+
+static void report_suppressed(ProcessStats *process)
+{
+    if (!process->rateLimited && !process->sampled)
+        return;
+    // Laid out like a relay record so every printer and the forwarder parse it as coming from deviceconsole
+    static char host[64];
+    if (!host[0]) {
+        if (gethostname(host, sizeof host) != 0)
+            strcpy(host, "localhost");
+        host[sizeof host - 1] = '\0';
+        host[strcspn(host, ". ")] = '\0';
+    }
+    char timestamp[16];
+    time_t now = time(NULL);
+    struct tm local;
+    strftime(timestamp, sizeof timestamp, "%b %e %H:%M:%S", localtime_r(&now, &local));
+    char line[256];
+    int length = snprintf(line, sizeof line, "%s %s deviceconsole[%d] <Notice>: suppressed %llu lines from %s (%llu rate limited, %llu sampled)\n",
+                          timestamp, host, (int)getpid(), (unsigned long long)(process->rateLimited + process->sampled), process->name,
+                          (unsigned long long)process->rateLimited, (unsigned long long)process->sampled);
+    if (length >= (int)sizeof line)
+        length = sizeof line - 1;
+    print_record(line, length);
+    process->rateLimited = 0;
+    process->sampled = 0;
+}
+
+static void SuppressionReportCallback(CFRunLoopTimerRef timer, void *info)
+{
+    for (size_t i = 0; i < PROCESS_TABLE_SIZE; i++)
+        if (processTable[i].used)
+            report_suppressed(&processTable[i]);
+    report_suppressed(&overflowProcess);
+    flush_output();
+}
+
+static bool set_sample_rate(const char *spec)
+{
+    static const char *levelNames[LogLevelCount] = { "Unknown", "Debug", "Info", "Notice", "Warning", "Error" };
+    const char *equals = strchr(spec, '=');
+    if (!equals)
+        return false;
+    for (int level = 0; level < LogLevelCount; level++) {
+        if (strlen(levelNames[level]) == (size_t)(equals - spec) && strncasecmp(spec, levelNames[level], equals - spec) == 0) {
+            if (level == LogLevelError)
+                return false;
+            double percent = strtod(equals + 1, NULL);
+            if (percent < 0)
+                percent = 0;
+            if (percent > 100)
+                percent = 100;
+            sampleRates[level] = (unsigned int)(percent * (SAMPLE_SCALE / 100));
+            return true;
+        }
+    }
+    return false;
+}
+
+#define write_const(fd, text) write_fully(fd, text, sizeof(text)-1)
+#define append_const(out, text) buffer_append(out, text, sizeof(text)-1)
+
+#define COLOR_RESET         "\e[m"
+#define COLOR_NORMAL        "\e[0m"
+#define COLOR_DARK          "\e[2m"
+#define COLOR_RED           "\e[0;31m"
+#define COLOR_DARK_RED      "\e[2;31m"
+#define COLOR_GREEN         "\e[0;32m"
+#define COLOR_DARK_GREEN    "\e[2;32m"
+#define COLOR_YELLOW        "\e[0;33m"
+#define COLOR_DARK_YELLOW   "\e[2;33m"
+#define COLOR_BLUE          "\e[0;34m"
+#define COLOR_DARK_BLUE     "\e[2;34m"
+#define COLOR_MAGENTA       "\e[0;35m"
+#define COLOR_DARK_MAGENTA  "\e[2;35m"
+#define COLOR_CYAN          "\e[0;36m"
+#define COLOR_DARK_CYAN     "\e[2;36m"
+#define COLOR_WHITE         "\e[0;37m"
+#define COLOR_DARK_WHITE    "\e[0;37m"
+
+static void write_colored(OutputBuffer *out, const char *buffer, size_t length)
+{
+    if (length < 16) {
+        buffer_append(out, buffer, length);
+        return;
+    }
+    size_t space_offsets[3];
+    int o = find_space_offsets(buffer, length, space_offsets);
+    
+    if (o == 3) {
+        
+        // Log date and device name
+        append_const(out, COLOR_DARK_WHITE);
+        buffer_append(out, buffer, space_offsets[0]);
+        // Log process name
+        int pos = 0;
+        for (int i = space_offsets[0]; i < space_offsets[0]; i++) {
+            if (buffer[i] == '[') {
+                pos = i;
+                break;
+            }
+        }
+        append_const(out, COLOR_CYAN);
+        if (pos && buffer[space_offsets[1]-1] == ']') {
+            buffer_append(out, buffer + space_offsets[0], pos - space_offsets[0]);
+            append_const(out, COLOR_DARK_CYAN);
+            buffer_append(out, buffer + pos, space_offsets[1] - pos);
+        } else {
+            buffer_append(out, buffer + space_offsets[0], space_offsets[1] - space_offsets[0]);
+        }
+        // Log level
+        size_t levelLength = space_offsets[2] - space_offsets[1];
+        if (levelLength > 4) {
+            const char *normalColor;
+            const char *darkColor;
+            if (levelLength == 9 && memcmp(buffer + space_offsets[1], " <Debug>:", 9) == 0){
+                normalColor = COLOR_MAGENTA;
+                darkColor = COLOR_DARK_MAGENTA;
+            } else if (levelLength == 11 && memcmp(buffer + space_offsets[1], " <Warning>:", 11) == 0){
+                normalColor = COLOR_YELLOW;
+                darkColor = COLOR_DARK_YELLOW;
+            } else if (levelLength == 9 && memcmp(buffer + space_offsets[1], " <Error>:", 9) == 0){
+                normalColor = COLOR_RED;
+                darkColor = COLOR_DARK_RED;
+            } else if (levelLength == 10 && memcmp(buffer + space_offsets[1], " <Notice>:", 10) == 0) {
+                normalColor = COLOR_GREEN;
+                darkColor = COLOR_DARK_GREEN;
+            } else {
+                goto level_unformatted;
+            }
+            buffer_append_string(out, darkColor);
+            buffer_append(out, buffer + space_offsets[1], 2);
+            buffer_append_string(out, normalColor);
+            buffer_append(out, buffer + space_offsets[1] + 2, levelLength - 4);
+            buffer_append_string(out, darkColor);
+            buffer_append(out, buffer + space_offsets[1] + levelLength - 2, 1);
+            append_const(out, COLOR_DARK_WHITE);
+            buffer_append(out, buffer + space_offsets[1] + levelLength - 1, 1);
+        } else {
+        level_unformatted:
+            append_const(out, COLOR_RESET);
+            buffer_append(out, buffer + space_offsets[1], levelLength);
+        }
+        append_const(out, COLOR_RESET);
+        buffer_append(out, buffer + space_offsets[2], length - space_offsets[2]);
+    } else {
+        buffer_append(out, buffer, length);
+    }
+}
+// Output templates: --format is compiled once into a flat list of literal
+// copies and field copies, which are replayed for every record
+
+static bool compile_format(const char *template)
+{
+    static const struct {
+        const char *name;
+        FormatField field;
+    } fieldNames[] = {
+        { "time", FormatFieldTime },
+        { "device", FormatFieldDevice },
+        { "proc", FormatFieldProcess },
+        { "pid", FormatFieldPid },
+        { "level", FormatFieldLevel },
+        { "msg", FormatFieldMessage },
+    };
+    const char *p = template;
+    while (*p) {
+        formatOps = realloc(formatOps, (formatOpCount + 1) * sizeof *formatOps);
+        FormatOp *op = &formatOps[formatOpCount++];
+        memset(op, 0, sizeof *op);
+        op->precision = SIZE_MAX;
+        if (*p != '%' || p[1] == '%') {
+            op->field = FormatFieldLiteral;
+            op->literal = p;
+            if (*p == '%') {
+                // "%%" emits a single '%'
+                op->literalLength = 1;
+                p += 2;
+            } else {
+                const char *end = strchr(p, '%');
+                op->literalLength = end ? (size_t)(end - p) : strlen(p);
+                p += op->literalLength;
+            }
+            continue;
+        }
+        const char *spec = p++;
+        if (*p == '-') {
+            op->leftAlign = true;
+            p++;
+        }
+        while (*p >= '0' && *p <= '9')
+            op->width = op->width * 10 + (*p++ - '0');
+        if (*p == '.') {
+            op->precision = 0;
+            p++;
+            while (*p >= '0' && *p <= '9')
+                op->precision = op->precision * 10 + (*p++ - '0');
+        }
+        size_t i;
+        for (i = 0; i < sizeof fieldNames / sizeof fieldNames[0]; i++) {
+            size_t nameLength = strlen(fieldNames[i].name);
+            if (strncmp(p, fieldNames[i].name, nameLength) == 0) {
+                op->field = fieldNames[i].field;
+                p += nameLength;
+                break;
+            }
+        }
+        if (i == sizeof fieldNames / sizeof fieldNames[0]) {
+            fprintf(stderr, "Unknown field `%s' in format; expected time, device, proc, pid, level or msg.\n", spec);
+            return false;
+        }
+    }
+    return true;
+}
+
+static void append_padded(OutputBuffer *out, const FormatOp *op, const char *text, size_t length)
+{
+    static const char spaces[] = "                                ";
+    if (length > op->precision)
+        length = op->precision;
+    size_t padding = op->width > length ? op->width - length : 0;
+    if (op->leftAlign)
+        buffer_append(out, text, length);
+    while (padding) {
+        size_t chunk = padding < sizeof spaces - 1 ? padding : sizeof spaces - 1;
+        buffer_append(out, spaces, chunk);
+        padding -= chunk;
+    }
+    if (!op->leftAlign)
+        buffer_append(out, text, length);
+}
+
+static void write_formatted(OutputBuffer *out, const char *buffer, size_t length)
+{
+    LogFields fields;
+    parse_log_fields(buffer, length, &fields);
+    for (int i = 0; i < formatOpCount; i++) {
+        const FormatOp *op = &formatOps[i];
+        switch (op->field) {
+            case FormatFieldLiteral:
+                buffer_append(out, op->literal, op->literalLength);
+                break;
+            case FormatFieldTime:
+                append_padded(out, op, fields.time, fields.timeLength);
+                break;
+            case FormatFieldDevice:
+                append_padded(out, op, fields.device, fields.deviceLength);
+                break;
+            case FormatFieldProcess:
+                append_padded(out, op, fields.process, fields.processLength);
+                break;
+            case FormatFieldPid:
+                append_padded(out, op, fields.pid, fields.pidLength);
+                break;
+            case FormatFieldLevel:
+                append_padded(out, op, fields.levelName, fields.levelNameLength);
+                break;
+            case FormatFieldMessage:
+                append_padded(out, op, fields.message, fields.messageLength);
+                break;
+        }
+    }
+    append_const(out, "\n");
+}
+
+// Template miner: a Drain-style fixed-depth parse tree over message bodies.
+// Messages are grouped by token count, then by their leading tokens, and
+// matched against the templates in that leaf by the fraction of equal tokens.
+// Templates are only allocated when first seen; mining a line doesn't allocate.
+//
+// The capture file (--template-capture) is line based:
+//   T<TAB>id<TAB>template          defines or redefines a template, "<*>" marking variables
+//   header<TAB>id<TAB>var<TAB>...  a record; header is the line up to the message
+// Tabs, newlines and backslashes in templates and variables are escaped with a backslash.
+
+static bool token_has_digit(const char *token, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+        if (token[i] >= '0' && token[i] <= '9')
+            return true;
+    return false;
+}
+
+static MinerNode *miner_node_create(void)
+{
+    return calloc(1, sizeof(MinerNode));
+}
+
+static MinerNode *miner_node_child(MinerNode *node, const char *token, size_t length)
+{
+    if (!token_has_digit(token, length)) {
+        for (int i = 0; i < node->childCount; i++)
+            if (node->children[i].keyLength == length && memcmp(node->children[i].key, token, length) == 0)
+                return node->children[i].node;
+        if (node->childCount < MINER_MAX_CHILDREN) {
+            node->children = realloc(node->children, (node->childCount + 1) * sizeof *node->children);
+            MinerChild *child = &node->children[node->childCount++];
+            child->key = strndup(token, length);
+            child->keyLength = length;
+            child->node = miner_node_create();
+            return child->node;
+        }
+    }
+    if (!node->wildcard)
+        node->wildcard = miner_node_create();
+    return node->wildcard;
+}
+
+static size_t tokenize_message(const char *message, size_t length, const char **tokens, size_t *tokenLengths)
+{
+    if (!length)
+        return 0;
+    size_t count = 0;
+    const char *end = message + length;
+    for (;;) {
+        const char *space = count == MINER_MAX_TOKENS - 1 ? NULL : memchr(message, ' ', end - message);
+        tokens[count] = message;
+        tokenLengths[count++] = (space ? space : end) - message;
+        if (!space)
+            return count;
+        message = space + 1;
+    }
+}
+
+static void append_escaped(OutputBuffer *out, const char *text, size_t length)
+{
+    const char *end = text + length;
+    while (text < end) {
+        const char *run = text;
+        while (text < end && *text != '\t' && *text != '\n' && *text != '\\')
+            text++;
+        buffer_append(out, run, text - run);
+        if (text == end)
+            break;
+        if (*text == '\t')
+            append_const(out, "\\t");
+        else if (*text == '\n')
+            append_const(out, "\\n");
+        else
+            append_const(out, "\\\\");
+        text++;
+    }
+}
+
+static void append_template(OutputBuffer *out, const LogTemplate *template, bool escaped)
+{
+    for (size_t i = 0; i < template->tokenCount; i++) {
+        if (i)
+            append_const(out, " ");
+        if (!template->tokens[i])
+            append_const(out, "<*>");
+        else if (escaped)
+            append_escaped(out, template->tokens[i], template->tokenLengths[i]);
+        else
+            buffer_append(out, template->tokens[i], template->tokenLengths[i]);
+    }
+}
+
+static void append_number(OutputBuffer *out, uint64_t value)
+{
+    char digits[24];
+    size_t count = 0;
+    do {
+        digits[sizeof digits - ++count] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    buffer_append(out, digits + sizeof digits - count, count);
+}
+
+static void capture_template_definition(const LogTemplate *template)
+{
+    append_const(&miner.capture, "T\t");
+    append_number(&miner.capture, template->id);
+    append_const(&miner.capture, "\t");
+    append_template(&miner.capture, template, true);
+    append_const(&miner.capture, "\n");
+}
+
+static LogTemplate *mine_message(const char *message, size_t length, const char **tokens, size_t *tokenLengths, size_t *tokenCount_out)
+{
+    size_t tokenCount = tokenize_message(message, length, tokens, tokenLengths);
+    *tokenCount_out = tokenCount;
+    MinerNode *node = miner.lengthNodes[tokenCount];
+    if (!node)
+        node = miner.lengthNodes[tokenCount] = miner_node_create();
+    for (size_t level = 0; level < MINER_TREE_DEPTH && level < tokenCount; level++)
+        node = miner_node_child(node, tokens[level], tokenLengths[level]);
+    
+    LogTemplate *best = NULL;
+    size_t bestMatches = 0;
+    size_t bestVariables = 0;
+    for (int i = 0; i < node->templateCount; i++) {
+        LogTemplate *template = node->templates[i];
+        size_t matches = 0;
+        size_t variables = 0;
+        for (size_t t = 0; t < tokenCount; t++) {
+            if (!template->tokens[t])
+                variables++;
+            else if (template->tokenLengths[t] == tokenLengths[t] && memcmp(template->tokens[t], tokens[t], tokenLengths[t]) == 0)
+                matches++;
+        }
+        if (!best || matches > bestMatches || (matches == bestMatches && variables > bestVariables)) {
+            best = template;
+            bestMatches = matches;
+            bestVariables = variables;
+        }
+    }
+    
+    if (best && (tokenCount == 0 || bestMatches >= tokenCount * MINER_SIMILARITY)) {
+        // Generalize any token that differs into a variable
+        bool changed = false;
+        for (size_t t = 0; t < tokenCount; t++) {
+            if (best->tokens[t] && (best->tokenLengths[t] != tokenLengths[t] || memcmp(best->tokens[t], tokens[t], tokenLengths[t]) != 0)) {
+                free(best->tokens[t]);
+                best->tokens[t] = NULL;
+                changed = true;
+            }
+        }
+        if (changed && miner.captureFd != -1)
+            capture_template_definition(best);
+        best->count++;
+        return best;
+    }
+    
+    LogTemplate *template = malloc(sizeof *template);
+    template->id = miner.templateCount;
+    template->tokenCount = tokenCount;
+    template->tokens = malloc(tokenCount * sizeof *template->tokens);
+    template->tokenLengths = malloc(tokenCount * sizeof *template->tokenLengths);
+    for (size_t t = 0; t < tokenCount; t++) {
+        template->tokens[t] = strndup(tokens[t], tokenLengths[t]);
+        template->tokenLengths[t] = tokenLengths[t];
+    }
+    template->count = 1;
+    node->templates = realloc(node->templates, (node->templateCount + 1) * sizeof *node->templates);
+    node->templates[node->templateCount++] = template;
+    miner.templates = realloc(miner.templates, (miner.templateCount + 1) * sizeof *miner.templates);
+    miner.templates[miner.templateCount++] = template;
+    if (miner.captureFd != -1)
+        capture_template_definition(template);
+    return template;
+}
+
+static void mine_record(const char *buffer, size_t length)
+{
+    static const char *tokens[MINER_MAX_TOKENS];
+    static size_t tokenLengths[MINER_MAX_TOKENS];
+    LogFields fields;
+    parse_log_fields(buffer, length, &fields);
+    size_t tokenCount;
+    LogTemplate *template = mine_message(fields.message, fields.messageLength, tokens, tokenLengths, &tokenCount);
+    if (miner.captureFd == -1)
+        return;
+    if (fields.time)
+        append_escaped(&miner.capture, buffer, fields.message - buffer - 1);
+    append_const(&miner.capture, "\t");
+    append_number(&miner.capture, template->id);
+    for (size_t t = 0; t < tokenCount; t++) {
+        if (!template->tokens[t]) {
+            append_const(&miner.capture, "\t");
+            append_escaped(&miner.capture, tokens[t], tokenLengths[t]);
+        }
+    }
+    append_const(&miner.capture, "\n");
+}
+
+static int compare_template_counts(const void *a, const void *b)
+{
+    uint64_t countA = (*(LogTemplate * const *)a)->count;
+    uint64_t countB = (*(LogTemplate * const *)b)->count;
+    return countA < countB ? 1 : countA > countB ? -1 : 0;
+}
+
+static void append_top_templates(OutputBuffer *out, size_t limit)
+{
+    LogTemplate **sorted = malloc(miner.templateCount * sizeof *sorted);
+    memcpy(sorted, miner.templates, miner.templateCount * sizeof *sorted);
+    qsort(sorted, miner.templateCount, sizeof *sorted, compare_template_counts);
+    uint64_t total = 0;
+    for (size_t i = 0; i < miner.templateCount; i++)
+        total += sorted[i]->count;
+    char header[96];
+    snprintf(header, sizeof header, "%zu templates over %llu lines\n", miner.templateCount, (unsigned long long)total);
+    buffer_append_string(out, header);
+    for (size_t i = 0; i < miner.templateCount && i < limit; i++) {
+        char line[64];
+        snprintf(line, sizeof line, "%10llu %5.1f%% #%-6u ", (unsigned long long)sorted[i]->count, total ? sorted[i]->count * 100.0 / total : 0.0, sorted[i]->id);
+        buffer_append_string(out, line);
+        append_template(out, sorted[i], false);
+        append_const(out, "\n");
+    }
+    free(sorted);
+}
+
+static void TopTemplatesCallback(CFRunLoopTimerRef timer, void *info)
+{
+    OutputBuffer report = { 0 };
+    append_top_templates(&report, MINER_TOP_COUNT);
+    buffer_flush(&report, 2);
+    free(report.bytes);
+}
+
+// Flight recorder: a fixed-size ring per device holding the most recent raw
+// syslog_relay bytes (NUL delimiters included), dumped to disk on demand.
+// Records are appended from the run loop thread only, so writes need no locks.
+
+static FlightRecorder *recorder_create(struct am_device *device)
+{
+    FlightRecorder *recorder = malloc(sizeof *recorder);
+    recorder->bytes = malloc(recorderCapacity);
+    recorder->capacity = recorderCapacity;
+    recorder->written = 0;
+    recorder->triggerHoldoffUntil = 0;
+    CFStringRef deviceId = AMDeviceCopyDeviceIdentifier(device);
+    if (!deviceId || !CFStringGetCString(deviceId, recorder->deviceId, sizeof recorder->deviceId, kCFStringEncodingUTF8))
+        strcpy(recorder->deviceId, "unknown");
+    if (deviceId)
+        CFRelease(deviceId);
+    return recorder;
+}
+
+static void recorder_free(FlightRecorder *recorder)
+{
+    free(recorder->bytes);
+    free(recorder);
+}
+
+static void recorder_append(FlightRecorder *recorder, const char *buffer, size_t length)
+{
+    size_t capacity = recorder->capacity;
+    recorder->written += length;
+    if (length > capacity) {
+        buffer += length - capacity;
+        length = capacity;
+    }
+    size_t head = (recorder->written - length) % capacity;
+    size_t firstLength = capacity - head;
+    if (firstLength > length)
+        firstLength = length;
+    memcpy(recorder->bytes + head, buffer, firstLength);
+    memcpy(recorder->bytes, buffer + firstLength, length - firstLength);
+}
+
+static bool recorder_dump(FlightRecorder *recorder, char *path_out, size_t pathSize)
+{
+    static unsigned int dumpCount;
+    char timestamp[32];
+    time_t now = time(NULL);
+    struct tm local;
+    strftime(timestamp, sizeof timestamp, "%Y%m%d-%H%M%S", localtime_r(&now, &local));
+    snprintf(path_out, pathSize, "%s/deviceconsole-%s-%s-%u.log", recorderDirectory, recorder->deviceId, timestamp, dumpCount++);
+    int fd = open(path_out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+        return false;
+    size_t capacity = recorder->capacity;
+    if (recorder->written <= capacity) {
+        write_fully(fd, recorder->bytes, recorder->written);
+    } else {
+        // Oldest bytes start at the write head; skip the record that was partially overwritten
+        size_t head = recorder->written % capacity;
+        const char *start = recorder->bytes + head;
+        const char *end = recorder->bytes + capacity;
+        const char *delimiter = memchr(start, '\0', end - start);
+        if (delimiter) {
+            write_fully(fd, delimiter, end - delimiter);
+            write_fully(fd, recorder->bytes, head);
+        } else {
+            delimiter = memchr(recorder->bytes, '\0', head);
+            if (delimiter)
+                write_fully(fd, delimiter, recorder->bytes + head - delimiter);
+        }
+    }
+    close(fd);
+    return true;
+}
+
+static int recorder_dump_logged(FlightRecorder *recorder, const char *reason)
+{
+    char path[PATH_MAX];
+    if (recorder_dump(recorder, path, sizeof path)) {
+        fprintf(stderr, "deviceconsole: flight recorder for %s dumped to %s (%s)\n", recorder->deviceId, path, reason);
+        return 1;
+    }
+    fprintf(stderr, "deviceconsole: unable to dump flight recorder to %s: %s\n", path, strerror(errno));
+    return 0;
+}
+
+typedef struct {
+    const char *reason;
+    int count;
+} RecorderDumpRequest;
+
+static void dump_connection_recorder(const void *key, const void *value, void *context)
+{
+    const DeviceConsoleConnection *data = value;
+    RecorderDumpRequest *request = context;
+    if (data->recorder)
+        request->count += recorder_dump_logged(data->recorder, request->reason);
+}
+
+static int dump_all_recorders(const char *reason)
+{
+    RecorderDumpRequest request = { reason, 0 };
+    CFDictionaryApplyFunction(liveConnections, dump_connection_recorder, &request);
+    return request.count;
+}
+
+static bool record_matches_trigger(const char *buffer, size_t length)
+{
+    size_t space_offsets[3];
+    int o = find_space_offsets(buffer, length, space_offsets);
+    for (int i = 0; i < recorderTriggerCount; i++) {
+        const RecorderTrigger *trigger = &recorderTriggers[i];
+        if (trigger->processName) {
+            if (o < 2)
+                continue;
+            const char *processName;
+            size_t nameLength = get_process_name(buffer, space_offsets, &processName);
+            if (!process_name_matches(processName, nameLength, trigger->processName))
+                continue;
+        }
+        if (memmem(buffer, length, trigger->text, strlen(trigger->text)))
+            return true;
+    }
+    return false;
+}
+
+static void add_recorder_trigger(const char *processName, const char *text)
+{
+    recorderTriggers = realloc(recorderTriggers, (recorderTriggerCount + 1) * sizeof *recorderTriggers);
+    RecorderTrigger *trigger = &recorderTriggers[recorderTriggerCount++];
+    trigger->processName = processName ? strdup(processName) : NULL;
+    trigger->text = strdup(text);
+}
+
+static bool add_process_recorder_trigger(const char *spec)
+{
+    // "process:text", split at the first colon since process names never contain one
+    const char *colon = strchr(spec, ':');
+    if (!colon || colon == spec)
+        return false;
+    char *processName = strndup(spec, colon - spec);
+    add_recorder_trigger(processName, colon + 1);
+    free(processName);
+    return true;
+}
+
+static void handle_dump_signal(int signal)
+{
+    int savedErrno = errno;
+    write(signalPipe[1], "", 1);
+    errno = savedErrno;
+}
+
+static void SignalCallback(CFFileDescriptorRef f, CFOptionFlags callBackTypes, void *info)
+{
+    char drain[64];
+    while (read(signalPipe[0], drain, sizeof drain) > 0) {
+    }
+    dump_all_recorders("SIGUSR2");
+    CFFileDescriptorEnableCallBacks(f, kCFFileDescriptorReadCallBack);
+}
+
+static bool install_dump_signal(void)
+{
+    if (pipe(signalPipe) == -1)
+        return false;
+    fcntl(signalPipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(signalPipe[1], F_SETFL, O_NONBLOCK);
+    CFFileDescriptorRef descriptor = CFFileDescriptorCreate(kCFAllocatorDefault, signalPipe[0], false, SignalCallback, NULL);
+    if (!descriptor)
+        return false;
+    CFFileDescriptorEnableCallBacks(descriptor, kCFFileDescriptorReadCallBack);
+    CFRunLoopSourceRef source = CFFileDescriptorCreateRunLoopSource(kCFAllocatorDefault, descriptor, 0);
+    if (!source)
+        return false;
+    CFRunLoopAddSource(CFRunLoopGetMain(), source, kCFRunLoopCommonModes);
+    CFRelease(source);
+    signal(SIGUSR2, handle_dump_signal);
+    return true;
+}
+
+// Forwarder: frames records as RFC 5424 syslog and sends them in batches to a
+// local collector, holding unsent frames in a bounded retry buffer
+
+static const char *monthNames[12] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+static size_t forwarder_frame_length(const char *bytes, size_t length)
+{
+    if (forwarder.lineFraming) {
+        const char *newline = memchr(bytes, '\n', length);
+        return newline ? (size_t)(newline - bytes) + 1 : length;
+    }
+    size_t frameLength = 0;
+    size_t i = 0;
+    while (i < length && bytes[i] >= '0' && bytes[i] <= '9')
+        frameLength = frameLength * 10 + (bytes[i++] - '0');
+    return i + 1 + frameLength;
+}
+
+static bool forwarder_reserve(size_t length)
+{
+    if (forwarder.pendingStart + forwarder.pendingLength + length <= forwarder.pendingCapacity)
+        return true;
+    if (forwarder.pendingLength + length > forwarder.retryLimit)
+        return false;
+    memmove(forwarder.pending, forwarder.pending + forwarder.pendingStart, forwarder.pendingLength);
+    forwarder.pendingStart = 0;
+    if (forwarder.pendingLength + length > forwarder.pendingCapacity) {
+        size_t capacity = forwarder.pendingCapacity ? forwarder.pendingCapacity : FORWARD_BATCH_SIZE;
+        while (capacity < forwarder.pendingLength + length)
+            capacity *= 2;
+        if (capacity > forwarder.retryLimit)
+            capacity = forwarder.retryLimit;
+        forwarder.pending = realloc(forwarder.pending, capacity);
+        forwarder.pendingCapacity = capacity;
+    }
+    return true;
+}
+
+static void forwarder_mark_queued(size_t length)
+{
+    // Frames queued within FORWARD_LATENCY_RESOLUTION of the last mark share its time
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    if (!forwarder.markCount || now - forwarder.marks[forwarder.markStart + forwarder.markCount - 1].queuedAt >= FORWARD_LATENCY_RESOLUTION) {
+        if (forwarder.markStart + forwarder.markCount == forwarder.markCapacity) {
+            if (forwarder.markStart) {
+                memmove(forwarder.marks, forwarder.marks + forwarder.markStart, forwarder.markCount * sizeof *forwarder.marks);
+                forwarder.markStart = 0;
+            } else {
+                forwarder.markCapacity = forwarder.markCapacity ? forwarder.markCapacity * 2 : 64;
+                forwarder.marks = realloc(forwarder.marks, forwarder.markCapacity * sizeof *forwarder.marks);
+            }
+        }
+        forwarder.marks[forwarder.markStart + forwarder.markCount++] = (ForwarderMark){ forwarder.streamQueued, now };
+    }
+    forwarder.streamQueued += length;
+}
+
+static void forwarder_consume(size_t length)
+{
+    forwarder.pendingStart += length;
+    forwarder.pendingLength -= length;
+    forwarder.streamConsumed += length;
+    if (forwarder.streamConsumed == forwarder.streamQueued) {
+        forwarder.markStart = 0;
+        forwarder.markCount = 0;
+        return;
+    }
+    while (forwarder.markCount > 1 && forwarder.marks[forwarder.markStart + 1].offset <= forwarder.streamConsumed) {
+        forwarder.markStart++;
+        forwarder.markCount--;
+    }
+}
+
+static void forwarder_spill(const char *frame, size_t length)
+{
+    if (length <= forwarder.retryLimit && pwrite(forwarder.spillFd, frame, length, forwarder.spillLength) == (ssize_t)length) {
+        forwarder_mark_queued(length);
+        forwarder.spillLength += length;
+        forwarder.spilled++;
+    } else {
+        forwarder.dropped++;
+    }
+}
+
+static bool forwarder_refill_from_spill(void)
+{
+    // Only called with an empty retry buffer; reads back whole frames in the order they were spilled
+    if (forwarder.spillReadOffset == forwarder.spillLength)
+        return false;
+    off_t remaining = forwarder.spillLength - forwarder.spillReadOffset;
+    size_t chunk = remaining < (off_t)forwarder.retryLimit ? (size_t)remaining : forwarder.retryLimit;
+    forwarder_reserve(chunk);
+    ssize_t result = pread(forwarder.spillFd, forwarder.pending, chunk, forwarder.spillReadOffset);
+    if (result <= 0)
+        return false;
+    size_t whole = 0;
+    while (whole < (size_t)result) {
+        size_t frameLength = forwarder_frame_length(forwarder.pending + whole, result - whole);
+        if (whole + frameLength > (size_t)result)
+            break;
+        whole += frameLength;
+    }
+    forwarder.pendingStart = 0;
+    forwarder.pendingLength = whole;
+    forwarder.spillReadOffset += whole;
+    if (forwarder.spillReadOffset == forwarder.spillLength) {
+        ftruncate(forwarder.spillFd, 0);
+        forwarder.spillReadOffset = 0;
+        forwarder.spillLength = 0;
+    }
+    return whole != 0;
+}
+
+static bool forwarder_resolve(void)
+{
+    // Resolved once at startup, since a lookup would block the run loop on every reconnect
+    if (strchr(forwarder.destination, '/')) {
+        struct sockaddr_un *address = calloc(1, sizeof *address);
+        if (strlen(forwarder.destination) >= sizeof address->sun_path) {
+            fprintf(stderr, "deviceconsole: socket path %s is too long\n", forwarder.destination);
+            free(address);
+            return false;
+        }
+        address->sun_family = AF_UNIX;
+        strcpy(address->sun_path, forwarder.destination);
+        forwarder.addresses = calloc(1, sizeof *forwarder.addresses);
+        forwarder.addresses->ai_family = AF_UNIX;
+        forwarder.addresses->ai_socktype = SOCK_STREAM;
+        forwarder.addresses->ai_addr = (struct sockaddr *)address;
+        forwarder.addresses->ai_addrlen = sizeof *address;
+        return true;
+    }
+    char host[256];
+    const char *colon = strrchr(forwarder.destination, ':');
+    if (!colon) {
+        fprintf(stderr, "Invalid destination `%s'; expected <host>:<port> or a unix socket path.\n", forwarder.destination);
+        return false;
+    }
+    const char *hostStart = forwarder.destination;
+    size_t hostLength = colon - hostStart;
+    if (hostLength >= 2 && hostStart[0] == '[' && hostStart[hostLength - 1] == ']') {
+        hostStart++;
+        hostLength -= 2;
+    }
+    if (hostLength >= sizeof host) {
+        fprintf(stderr, "Invalid destination `%s'; the host name is too long.\n", forwarder.destination);
+        return false;
+    }
+    memcpy(host, hostStart, hostLength);
+    host[hostLength] = '\0';
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    int error = getaddrinfo(host, colon + 1, &hints, &forwarder.addresses);
+    if (error) {
+        fprintf(stderr, "deviceconsole: unable to resolve %s: %s\n", forwarder.destination, gai_strerror(error));
+        return false;
+    }
+    return true;
+}
+
+static void forwarder_connected(void)
+{
+#ifdef SO_NOSIGPIPE
+    int noSigPipe = 1;
+    setsockopt(forwarder.fd, SOL_SOCKET, SO_NOSIGPIPE, &noSigPipe, sizeof noSigPipe);
+#endif
+    forwarder.connecting = false;
+    if (debug)
+        fprintf(stderr, "deviceconsole: forwarding to %s\n", forwarder.destination);
+}
+
+static void forwarder_abandon_connect(void)
+{
+    close(forwarder.fd);
+    forwarder.fd = -1;
+    forwarder.connecting = false;
+}
 
-static inline void write_fully(int fd, const char *buffer, size_t length)
+static bool forwarder_connect(void)
 {
-    while (length) {
-        ssize_t result = write(fd, buffer, length);
-        if (result == -1)
-            break;
-        buffer += result;
-        length -= result;
+    // Connects never block the run loop; a pending one is finished here once the socket turns writable
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    if (forwarder.connecting) {
+        struct pollfd writable = { .fd = forwarder.fd, .events = POLLOUT };
+        if (poll(&writable, 1, 0) == 0) {
+            if (now - forwarder.connectStartedAt >= FORWARD_CONNECT_TIMEOUT)
+                forwarder_abandon_connect();
+            return false;
+        }
+        int error = 0;
+        socklen_t errorLength = sizeof error;
+        if (getsockopt(forwarder.fd, SOL_SOCKET, SO_ERROR, &error, &errorLength) == -1 || error != 0) {
+            forwarder_abandon_connect();
+            return false;
+        }
+        forwarder_connected();
+        return true;
+    }
+    if (now < forwarder.nextConnectAt)
+        return false;
+    forwarder.nextConnectAt = now + FORWARD_RECONNECT_INTERVAL;
+    
+    // Each attempt tries the next resolved address in turn
+    if (!forwarder.nextAddress)
+        forwarder.nextAddress = forwarder.addresses;
+    struct addrinfo *address = forwarder.nextAddress;
+    forwarder.nextAddress = address->ai_next;
+    int fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+    if (fd == -1)
+        return false;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    forwarder.fd = fd;
+    if (connect(fd, address->ai_addr, address->ai_addrlen) == 0) {
+        forwarder_connected();
+        return true;
     }
+    if (errno == EINPROGRESS) {
+        forwarder.connecting = true;
+        forwarder.connectStartedAt = now;
+    } else {
+        forwarder_abandon_connect();
+    }
+    return false;
 }
 
-static inline void write_string(int fd, const char *string)
+static void forwarder_disconnect(void)
 {
-    write_fully(fd, string, strlen(string));
+    close(forwarder.fd);
+    forwarder.fd = -1;
+    // The collector saw only part of the frame at the head; resending its tail would corrupt the stream
+    if (forwarder.frameSent) {
+        size_t frameLength = forwarder_frame_length(forwarder.pending + forwarder.pendingStart, forwarder.pendingLength);
+        forwarder_consume(frameLength - forwarder.frameSent);
+        forwarder.frameSent = 0;
+        forwarder.dropped++;
+    }
+    if (debug)
+        fprintf(stderr, "deviceconsole: lost connection to %s\n", forwarder.destination);
 }
 
-static int find_space_offsets(const char *buffer, size_t length, size_t *space_offsets_out)
+static void forwarder_flush(void)
 {
-    int o = 0;
-    for (size_t i = 16; i < length; i++) {
-        if (buffer[i] == ' ') {
-            space_offsets_out[o++] = i;
-            if (o == 3) {
-                break;
+    if ((forwarder.fd == -1 || forwarder.connecting) && !forwarder_connect())
+        return;
+    // Everything one flush writes counts as one batch, its latency taken from the oldest frame it sends
+    size_t batchLength = 0;
+    CFAbsoluteTime oldestQueuedAt = 0;
+    while (forwarder.pendingLength || forwarder_refill_from_spill()) {
+        ssize_t result = write(forwarder.fd, forwarder.pending + forwarder.pendingStart, forwarder.pendingLength);
+        if (result == -1) {
+            if (errno != EAGAIN && errno != EINTR)
+                forwarder_disconnect();
+            break;
+        }
+        if (!batchLength)
+            oldestQueuedAt = forwarder.marks[forwarder.markStart].queuedAt;
+        batchLength += result;
+        // Walk the frames covered by this write so a later disconnect knows where the next frame starts
+        size_t advance = result;
+        while (advance) {
+            size_t frameLength = forwarder_frame_length(forwarder.pending + forwarder.pendingStart, forwarder.pendingLength);
+            size_t remaining = frameLength - forwarder.frameSent;
+            size_t step = advance < remaining ? advance : remaining;
+            forwarder_consume(step);
+            advance -= step;
+            if (step == remaining) {
+                forwarder.frameSent = 0;
+                forwarder.sent++;
+            } else {
+                forwarder.frameSent += step;
             }
         }
+        if (!forwarder.pendingLength)
+            forwarder.pendingStart = 0;
+    }
+    if (batchLength) {
+        CFAbsoluteTime latency = CFAbsoluteTimeGetCurrent() - oldestQueuedAt;
+        forwarder.batches++;
+        forwarder.bytesSent += batchLength;
+        if (batchLength > forwarder.maxBatch)
+            forwarder.maxBatch = batchLength;
+        forwarder.totalLatency += latency;
+        if (latency > forwarder.maxLatency)
+            forwarder.maxLatency = latency;
     }
-    return o;
 }
-static unsigned char should_print_message(const char *buffer, size_t length)
+
+static void forwarder_queue(const char *frame, size_t length)
 {
-    if (length < 3) return 0; // don't want blank lines
+    forwarder.queued++;
+    // Once anything has spilled, later frames follow it to disk to keep the stream in order
+    if (forwarder.spillLength != forwarder.spillReadOffset) {
+        forwarder_spill(frame, length);
+        return;
+    }
+    if (!forwarder_reserve(length)) {
+        if (forwarder.spillFd != -1)
+            forwarder_spill(frame, length);
+        else
+            forwarder.dropped++;
+        return;
+    }
+    forwarder_mark_queued(length);
+    memcpy(forwarder.pending + forwarder.pendingStart + forwarder.pendingLength, frame, length);
+    forwarder.pendingLength += length;
+    if (forwarder.pendingLength >= FORWARD_BATCH_SIZE)
+        forwarder_flush();
+}
+
+static char *append_field(char *out, const char *field, size_t length, size_t maxLength)
+{
+    if (!length) {
+        *out++ = '-';
+    } else {
+        if (length > maxLength)
+            length = maxLength;
+        memcpy(out, field, length);
+        out += length;
+    }
+    *out++ = ' ';
+    return out;
+}
+
+static void forward_message(OutputBuffer *unused, const char *buffer, size_t length)
+{
+    static char *frame;
+    static size_t frameCapacity;
+    static const int severities[LogLevelCount] = { 5, 7, 6, 5, 4, 3 };
+    LogFields fields;
+    parse_log_fields(buffer, length, &fields);
     
-    size_t space_offsets[3];
-    find_space_offsets(buffer, length, space_offsets);
+    // Header: <PRI>1 TIMESTAMP HOSTNAME APP-NAME PROCID MSGID STRUCTURED-DATA
+    char header[512];
+    char *out = header;
+    *out++ = '<';
+    int priority = 8 + severities[fields.level]; // facility 1 (user)
+    if (priority >= 10)
+        *out++ = '0' + priority / 10;
+    *out++ = '0' + priority % 10;
+    memcpy(out, ">1 ", 3);
+    out += 3;
+    int month = -1;
+    if (fields.timeLength == 15) {
+        for (month = 0; month < 12; month++)
+            if (memcmp(fields.time, monthNames[month], 3) == 0)
+                break;
+    }
+    if (month >= 0 && month < 12) {
+        // The relay omits the year and zone; assume the current year and the host's offset
+        int year = forwarder.year;
+        out[0] = '0' + year / 1000;
+        out[1] = '0' + year / 100 % 10;
+        out[2] = '0' + year / 10 % 10;
+        out[3] = '0' + year % 10;
+        out[4] = '-';
+        out[5] = '0' + (month + 1) / 10;
+        out[6] = '0' + (month + 1) % 10;
+        out[7] = '-';
+        out[8] = fields.time[4] == ' ' ? '0' : fields.time[4];
+        out[9] = fields.time[5];
+        out[10] = 'T';
+        memcpy(out + 11, fields.time + 7, 8);
+        memcpy(out + 19, forwarder.utcOffset, 6);
+        out[25] = ' ';
+        out += 26;
+    } else {
+        memcpy(out, "- ", 2);
+        out += 2;
+    }
+    out = append_field(out, fields.device, fields.deviceLength, 255);
+    out = append_field(out, fields.process, fields.processLength, 48);
+    out = append_field(out, fields.pid, fields.pidLength, 128);
+    memcpy(out, "- - ", 4);
+    out += 4;
+    size_t headerLength = out - header;
     
-    // Check whether process name matches the one passed to -p option and filter if needed
-    if (requiredProcessName != NULL) {
-        int nameLength = space_offsets[1] - space_offsets[0]; //This size includes the NULL terminator.
-        
-        char *processName = malloc(nameLength);
-        processName[nameLength - 1] = '\0';
-        memcpy(processName, buffer + space_offsets[0] + 1, nameLength - 1);
+    size_t messageLength = headerLength + fields.messageLength;
+    size_t frameLength = messageLength + 24;
+    if (frameLength > frameCapacity) {
+        frameCapacity = frameLength * 2;
+        frame = realloc(frame, frameCapacity);
+    }
+    size_t offset = 0;
+    if (!forwarder.lineFraming) {
+        // Octet counting (RFC 6587): "LENGTH SP MESSAGE"
+        char digits[24];
+        size_t digitCount = 0;
+        do {
+            digits[digitCount++] = '0' + messageLength % 10;
+            messageLength /= 10;
+        } while (messageLength);
+        while (digitCount)
+            frame[offset++] = digits[--digitCount];
+        frame[offset++] = ' ';
+    }
+    memcpy(frame + offset, header, headerLength);
+    offset += headerLength;
+    memcpy(frame + offset, fields.message, fields.messageLength);
+    if (forwarder.lineFraming) {
+        // Newline framing can't carry embedded newlines
+        for (char *newline = frame + offset; (newline = memchr(newline, '\n', frame + offset + fields.messageLength - newline)); )
+            *newline = ' ';
+    }
+    offset += fields.messageLength;
+    if (forwarder.lineFraming)
+        frame[offset++] = '\n';
+    forwarder_queue(frame, offset);
+}
 
-        for (int i = strlen(processName); i != 0; i--)
-            if (processName[i] == '[')
-                processName[i] = '\0';
-        
-        if (strcmp(processName, requiredProcessName) != 0){
-            free(processName);
-            return 0;
+static void update_forwarder_clock(void)
+{
+    time_t now = time(NULL);
+    struct tm local;
+    localtime_r(&now, &local);
+    forwarder.year = local.tm_year + 1900;
+    long offset = local.tm_gmtoff / 60;
+    forwarder.utcOffset[0] = offset < 0 ? '-' : '+';
+    if (offset < 0)
+        offset = -offset;
+    forwarder.utcOffset[1] = '0' + offset / 600;
+    forwarder.utcOffset[2] = '0' + offset / 60 % 10;
+    forwarder.utcOffset[3] = ':';
+    forwarder.utcOffset[4] = '0' + offset % 60 / 10;
+    forwarder.utcOffset[5] = '0' + offset % 10;
+}
+
+static void ForwarderTimerCallback(CFRunLoopTimerRef timer, void *info)
+{
+    update_forwarder_clock();
+    forwarder_flush();
+}
+
+static bool start_forwarder(void)
+{
+    if (forwarder.spillPath) {
+        forwarder.spillFd = open(forwarder.spillPath, O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (forwarder.spillFd == -1)
+            return false;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    update_forwarder_clock();
+    forwarder_flush();
+    CFRunLoopTimerRef timer = CFRunLoopTimerCreate(kCFAllocatorDefault, CFAbsoluteTimeGetCurrent() + FORWARD_FLUSH_INTERVAL, FORWARD_FLUSH_INTERVAL, 0, 0, ForwarderTimerCallback, NULL);
+    CFRunLoopAddTimer(CFRunLoopGetMain(), timer, kCFRunLoopCommonModes);
+    CFRelease(timer);
+    return true;
+}
+
+static void write_forwarder_stats(int fd)
+{
+    char stats[512];
+    snprintf(stats, sizeof stats,
+             "forwarder connected=%d queued=%llu sent=%llu dropped=%llu spilled=%llu pending_bytes=%zu spill_bytes=%lld "
+             "batches=%llu bytes=%llu avg_batch_bytes=%llu max_batch_bytes=%zu avg_latency_ms=%.3f max_latency_ms=%.3f\n",
+             forwarder.fd != -1 && !forwarder.connecting, (unsigned long long)forwarder.queued, (unsigned long long)forwarder.sent,
+             (unsigned long long)forwarder.dropped, (unsigned long long)forwarder.spilled, forwarder.pendingLength,
+             (long long)(forwarder.spillLength - forwarder.spillReadOffset), (unsigned long long)forwarder.batches,
+             (unsigned long long)forwarder.bytesSent, (unsigned long long)(forwarder.batches ? forwarder.bytesSent / forwarder.batches : 0),
+             forwarder.maxBatch, forwarder.batches ? forwarder.totalLatency * 1000 / forwarder.batches : 0.0, forwarder.maxLatency * 1000);
+    write_string(fd, stats);
+}
+
+// Control socket: a unix socket accepting one-line commands
+
+static bool is_control_command(const char *command, size_t length, const char *name)
+{
+    size_t nameLength = strlen(name);
+    while (length && isspace((unsigned char)command[length - 1]))
+        length--;
+    return length == nameLength && memcmp(command, name, nameLength) == 0;
+}
+
+static void run_control_command(int fd, const char *command, size_t length)
+{
+    if (is_control_command(command, length, "")) {
+        return;
+    } else if (is_control_command(command, length, "dump")) {
+        char reply[32];
+        snprintf(reply, sizeof reply, "dumped %d\n", dump_all_recorders("control socket"));
+        write_string(fd, reply);
+    } else if (is_control_command(command, length, "top")) {
+        if (miningEnabled) {
+            OutputBuffer report = { 0 };
+            append_top_templates(&report, MINER_TOP_COUNT);
+            buffer_flush(&report, fd);
+            free(report.bytes);
+        } else {
+            write_const(fd, "template mining disabled\n");
         }
-        free(processName);
+    } else if (is_control_command(command, length, "stats")) {
+        if (forwarder.destination)
+            write_forwarder_stats(fd);
+        else
+            write_const(fd, "forwarder disabled\n");
+    } else {
+        write_const(fd, "unknown command\n");
     }
-    
-    // More filtering options can be added here and return 0 when they won't meed filter criteria
-    
-    return 1;
 }
 
-#define write_const(fd, text) write_fully(fd, text, sizeof(text)-1)
+static void ControlDataCallback(CFSocketRef s, CFSocketCallBackType type, CFDataRef address, const void *data, void *info)
+{
+    ControlClient *client = info;
+    int fd = CFSocketGetNative(s);
+    CFIndex length = CFDataGetLength(data);
+    if (length == 0) {
+        // The last command may end at the close instead of a newline
+        if (!client->overlong)
+            run_control_command(fd, client->line, client->length);
+        CFSocketInvalidate(s);
+        CFRelease(s);
+        return;
+    }
+    // Commands end at a newline and may arrive split across reads or several to a read
+    const char *bytes = (const char *)CFDataGetBytePtr(data);
+    const char *end = bytes + length;
+    while (bytes != end) {
+        const char *newline = memchr(bytes, '\n', end - bytes);
+        size_t run = (newline ? newline : end) - bytes;
+        if (client->length + run > sizeof client->line)
+            client->overlong = true;
+        if (!client->overlong) {
+            memcpy(client->line + client->length, bytes, run);
+            client->length += run;
+        }
+        if (!newline)
+            break;
+        if (client->overlong)
+            write_const(fd, "command too long\n");
+        else
+            run_control_command(fd, client->line, client->length);
+        client->length = 0;
+        client->overlong = false;
+        bytes = newline + 1;
+    }
+}
 
-#define COLOR_RESET         "\e[m"
-#define COLOR_NORMAL        "\e[0m"
-#define COLOR_DARK          "\e[2m"
-#define COLOR_RED           "\e[0;31m"
-#define COLOR_DARK_RED      "\e[2;31m"
-#define COLOR_GREEN         "\e[0;32m"
-#define COLOR_DARK_GREEN    "\e[2;32m"
-#define COLOR_YELLOW        "\e[0;33m"
-#define COLOR_DARK_YELLOW   "\e[2;33m"
-#define COLOR_BLUE          "\e[0;34m"
-#define COLOR_DARK_BLUE     "\e[2;34m"
-#define COLOR_MAGENTA       "\e[0;35m"
-#define COLOR_DARK_MAGENTA  "\e[2;35m"
-#define COLOR_CYAN          "\e[0;36m"
-#define COLOR_DARK_CYAN     "\e[2;36m"
-#define COLOR_WHITE         "\e[0;37m"
-#define COLOR_DARK_WHITE    "\e[0;37m"
+static void release_control_client(const void *info)
+{
+    free((void *)info);
+}
 
-static void write_colored(int fd, const char *buffer, size_t length)
+static void ControlAcceptCallback(CFSocketRef s, CFSocketCallBackType type, CFDataRef address, const void *data, void *info)
 {
-    if (length < 16) {
-        write_fully(fd, buffer, length);
+    CFSocketNativeHandle handle = *(const CFSocketNativeHandle *)data;
+    ControlClient *state = calloc(1, sizeof *state);
+    CFSocketContext context = { 0, state, NULL, release_control_client, NULL };
+    CFSocketRef client = CFSocketCreateWithNative(kCFAllocatorDefault, handle, kCFSocketDataCallBack, ControlDataCallback, &context);
+    if (!client) {
+        free(state);
+        close(handle);
         return;
     }
-    size_t space_offsets[3];
-    int o = find_space_offsets(buffer, length, space_offsets);
-    
-    if (o == 3) {
-        
-        // Log date and device name
-        write_const(fd, COLOR_DARK_WHITE);
-        write_fully(fd, buffer, space_offsets[0]);
-        // Log process name
-        int pos = 0;
-        for (int i = space_offsets[0]; i < space_offsets[0]; i++) {
-            if (buffer[i] == '[') {
-                pos = i;
-                break;
-            }
+    CFRunLoopSourceRef source = CFSocketCreateRunLoopSource(kCFAllocatorDefault, client, 0);
+    if (!source) {
+        CFSocketInvalidate(client);
+        CFRelease(client);
+        return;
+    }
+    CFRunLoopAddSource(CFRunLoopGetMain(), source, kCFRunLoopCommonModes);
+    CFRelease(source);
+}
+
+static bool listen_on_control_socket(const char *path)
+{
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof address.sun_path) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    strcpy(address.sun_path, path);
+    // Only replace a stale socket; never delete some other file that happens to be at path
+    struct stat existing;
+    if (lstat(path, &existing) == 0) {
+        if (!S_ISSOCK(existing.st_mode)) {
+            errno = EEXIST;
+            return false;
         }
-        write_const(fd, COLOR_CYAN);
-        if (pos && buffer[space_offsets[1]-1] == ']') {
-            write_fully(fd, buffer + space_offsets[0], pos - space_offsets[0]);
-            write_const(fd, COLOR_DARK_CYAN);
-            write_fully(fd, buffer + pos, space_offsets[1] - pos);
-        } else {
-            write_fully(fd, buffer + space_offsets[0], space_offsets[1] - space_offsets[0]);
+        if (unlink(path) == -1)
+            return false;
+    } else if (errno != ENOENT) {
+        return false;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1)
+        return false;
+    if (bind(fd, (struct sockaddr *)&address, sizeof address) == -1 || listen(fd, 4) == -1) {
+        close(fd);
+        return false;
+    }
+    CFSocketRef socket = CFSocketCreateWithNative(kCFAllocatorDefault, fd, kCFSocketAcceptCallBack, ControlAcceptCallback, NULL);
+    if (!socket) {
+        close(fd);
+        return false;
+    }
+    CFRunLoopSourceRef source = CFSocketCreateRunLoopSource(kCFAllocatorDefault, socket, 0);
+    if (!source) {
+        CFSocketInvalidate(socket);
+        CFRelease(socket);
+        return false;
+    }
+    CFRunLoopAddSource(CFRunLoopGetMain(), source, kCFRunLoopCommonModes);
+    CFRelease(source);
+    return true;
+}
+
+// Offline mode: reprocesses a raw syslog_relay capture (such as a flight
+// recorder dump) by splitting it into chunks at record boundaries, filtering
+// and formatting the chunks on worker threads, and writing them out in order
+
+static void process_chunk(OfflineChunk *chunk)
+{
+    const char *cursor = chunk->start;
+    const char *record;
+    size_t recordLength;
+    while (next_record(&cursor, chunk->end, &record, &recordLength)) {
+        if (should_print_message(record, recordLength)) {
+            printMessage(&chunk->output, record, recordLength);
+            printSeparator(&chunk->output);
         }
-        // Log level
-        size_t levelLength = space_offsets[2] - space_offsets[1];
-        if (levelLength > 4) {
-            const char *normalColor;
-            const char *darkColor;
-            if (levelLength == 9 && memcmp(buffer + space_offsets[1], " <Debug>:", 9) == 0){
-                normalColor = COLOR_MAGENTA;
-                darkColor = COLOR_DARK_MAGENTA;
-            } else if (levelLength == 11 && memcmp(buffer + space_offsets[1], " <Warning>:", 11) == 0){
-                normalColor = COLOR_YELLOW;
-                darkColor = COLOR_DARK_YELLOW;
-            } else if (levelLength == 9 && memcmp(buffer + space_offsets[1], " <Error>:", 9) == 0){
-                normalColor = COLOR_RED;
-                darkColor = COLOR_DARK_RED;
-            } else if (levelLength == 10 && memcmp(buffer + space_offsets[1], " <Notice>:", 10) == 0) {
-                normalColor = COLOR_GREEN;
-                darkColor = COLOR_DARK_GREEN;
-            } else {
-                goto level_unformatted;
-            }
-            write_string(fd, darkColor);
-            write_fully(fd, buffer + space_offsets[1], 2);
-            write_string(fd, normalColor);
-            write_fully(fd, buffer + space_offsets[1] + 2, levelLength - 4);
-            write_string(fd, darkColor);
-            write_fully(fd, buffer + space_offsets[1] + levelLength - 2, 1);
-            write_const(fd, COLOR_DARK_WHITE);
-            write_fully(fd, buffer + space_offsets[1] + levelLength - 1, 1);
-        } else {
-        level_unformatted:
-            write_const(fd, COLOR_RESET);
-            write_fully(fd, buffer + space_offsets[1], levelLength);
+    }
+}
+
+static void *offline_worker(void *context)
+{
+    OfflineJob *job = context;
+    pthread_mutex_lock(&job->lock);
+    for (;;) {
+        // Stay a bounded number of chunks ahead of the writer so memory use stays flat
+        while (job->nextChunk < job->chunkCount && job->nextChunk >= job->written + job->window)
+            pthread_cond_wait(&job->chunkWritten, &job->lock);
+        if (job->nextChunk == job->chunkCount)
+            break;
+        OfflineChunk *chunk = &job->chunks[job->nextChunk++];
+        pthread_mutex_unlock(&job->lock);
+        process_chunk(chunk);
+        pthread_mutex_lock(&job->lock);
+        chunk->done = true;
+        pthread_cond_broadcast(&job->chunkDone);
+    }
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
+}
+
+static int process_capture_file(const char *path, long threadCount)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "deviceconsole: unable to open %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    struct stat info;
+    if (fstat(fd, &info) == -1) {
+        fprintf(stderr, "deviceconsole: unable to open %s: %s\n", path, strerror(errno));
+        close(fd);
+        return 1;
+    }
+    if (info.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    const char *contents = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (contents == MAP_FAILED) {
+        fprintf(stderr, "deviceconsole: unable to map %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    madvise((void *)contents, info.st_size, MADV_SEQUENTIAL);
+    
+    // Split at the first NUL past each chunk size so no record straddles two chunks
+    OfflineJob job = { 0 };
+    const char *end = contents + info.st_size;
+    for (const char *start = contents; start != end; ) {
+        const char *chunkEnd = end - start > OFFLINE_CHUNK_SIZE ? start + OFFLINE_CHUNK_SIZE : end;
+        const char *delimiter = memchr(chunkEnd, '\0', end - chunkEnd);
+        chunkEnd = delimiter ? delimiter + 1 : end;
+        job.chunks = realloc(job.chunks, (job.chunkCount + 1) * sizeof *job.chunks);
+        job.chunks[job.chunkCount++] = (OfflineChunk){ start, chunkEnd, { 0 }, false };
+        start = chunkEnd;
+    }
+    
+    if (threadCount < 1)
+        threadCount = 1;
+    if ((size_t)threadCount > job.chunkCount)
+        threadCount = job.chunkCount;
+    job.window = threadCount * 4;
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.chunkDone, NULL);
+    pthread_cond_init(&job.chunkWritten, NULL);
+    pthread_t *threads = malloc(threadCount * sizeof *threads);
+    long started = 0;
+    while (started < threadCount && pthread_create(&threads[started], NULL, offline_worker, &job) == 0)
+        started++;
+    if (started < threadCount && debug)
+        fprintf(stderr, "deviceconsole: started %ld of %ld worker threads\n", started, threadCount);
+    
+    for (size_t i = 0; i < job.chunkCount; i++) {
+        OfflineChunk *chunk = &job.chunks[i];
+        if (!started) {
+            // No worker could be started, so the writer formats each chunk itself
+            process_chunk(chunk);
+            chunk->done = true;
         }
-        write_const(fd, COLOR_RESET);
-        write_fully(fd, buffer + space_offsets[2], length - space_offsets[2]);
-    } else {
-        write_fully(fd, buffer, length);
+        pthread_mutex_lock(&job.lock);
+        while (!chunk->done)
+            pthread_cond_wait(&job.chunkDone, &job.lock);
+        pthread_mutex_unlock(&job.lock);
+        buffer_flush(&chunk->output, 1);
+        free(chunk->output.bytes);
+        pthread_mutex_lock(&job.lock);
+        job.written = i + 1;
+        pthread_cond_broadcast(&job.chunkWritten);
+        pthread_mutex_unlock(&job.lock);
     }
+    
+    for (long i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    free(job.chunks);
+    munmap((void *)contents, info.st_size);
+    return 0;
 }
+
 static void SocketCallback(CFSocketRef s, CFSocketCallBackType type, CFDataRef address, const void *data, void *info)
 {
-    // Skip null bytes
-    ssize_t length = CFDataGetLength(data);
-    const char *buffer = (const char *)CFDataGetBytePtr(data);
-    while (length) {
-        while (*buffer == '\0') {
-            buffer++;
-            length--;
-            if (length == 0)
-                return;
-        }
-        size_t extentLength = 0;
-        while ((buffer[extentLength] != '\0') && extentLength != length) {
-            extentLength++;
+    DeviceConsoleConnection *connection = info;
+    FlightRecorder *recorder = connection->recorder;
+    CFIndex length = CFDataGetLength(data);
+    const char *cursor = (const char *)CFDataGetBytePtr(data);
+    if (recorder)
+        recorder_append(recorder, cursor, length);
+    const char *end = cursor + length;
+    const char *buffer;
+    size_t extentLength;
+    while (next_record(&cursor, end, &buffer, &extentLength)) {
+        if (recorder && recorderTriggerCount && record_matches_trigger(buffer, extentLength)) {
+            CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+            if (now >= recorder->triggerHoldoffUntil) {
+                recorder_dump_logged(recorder, "trigger");
+                recorder->triggerHoldoffUntil = now + RECORDER_TRIGGER_HOLDOFF;
+            } else {
+                fprintf(stderr, "deviceconsole: flight recorder for %s not dumped for a trigger %.1f seconds after the last one\n",
+                        recorder->deviceId, now - (recorder->triggerHoldoffUntil - RECORDER_TRIGGER_HOLDOFF));
+            }
         }
         
-        if (should_print_message(buffer, extentLength)) {
-            printMessage(1, buffer, extentLength);
-            printSeparator(1);
-        }
+        if (miningEnabled)
+            mine_record(buffer, extentLength);
         
-        length -= extentLength;
-        buffer += extentLength;
+        if (should_print_message(buffer, extentLength) && (!limitingEnabled || admit_message(buffer, extentLength))) {
+            print_record(buffer, extentLength);
+        }
+    }
+    flush_output();
+}
+
+// Passthrough: when nothing needs to look at individual records, bytes are read
+// straight from the relay socket into one reusable buffer and written to
+// standard out, skipping the CFData copy and the per-record work
+
+static size_t strip_delimiters(char *buffer, size_t length, DeviceConsoleConnection *connection)
+{
+    // Compact records in place, dropping the NULs and records shorter than three bytes like
+    // should_print_message does, and end each record with a newline if it lacks one
+    char *out = buffer;
+    char *recordStart = buffer;
+    const char *in = buffer;
+    const char *end = buffer + length;
+    size_t recordLength = connection->recordLength;
+    while (in != end) {
+        const char *delimiter = memchr(in, '\0', end - in);
+        size_t run = (delimiter ? delimiter : end) - in;
+        if (run) {
+            // The held bytes began this record in an earlier read, before anything in this one
+            if (connection->heldLength && recordLength + run >= 3) {
+                write_fully(1, connection->held, connection->heldLength);
+                connection->heldLength = 0;
+            }
+            if (out != in)
+                memmove(out, in, run);
+            out += run;
+            recordLength += run;
+            connection->lastByte = in[run - 1];
+        }
+        if (!delimiter)
+            break;
+        if (recordLength < 3) {
+            out = recordStart;
+            connection->heldLength = 0;
+        } else if (connection->lastByte != '\n') {
+            *out++ = '\n';
+        }
+        recordLength = 0;
+        recordStart = out;
+        in = delimiter + 1;
+    }
+    if (recordLength && recordLength < 3) {
+        // Too short to tell yet; hold on to it until the rest of the record arrives
+        memcpy(connection->held + connection->heldLength, recordStart, out - recordStart);
+        connection->heldLength += out - recordStart;
+        out = recordStart;
+    }
+    connection->recordLength = recordLength;
+    return out - buffer;
+}
+
+static void PassthroughCallback(CFSocketRef s, CFSocketCallBackType type, CFDataRef address, const void *data, void *info)
+{
+    static char buffer[PASSTHROUGH_BUFFER_SIZE];
+    DeviceConsoleConnection *connection = info;
+    ssize_t length = read(CFSocketGetNative(s), buffer, sizeof buffer);
+    if (length <= 0) {
+        // Stop polling a closed relay; the disconnect notification tears the connection down
+        if (length == 0 || (errno != EAGAIN && errno != EINTR))
+            CFSocketDisableCallBacks(s, kCFSocketReadCallBack);
+        return;
     }
+    if (!rawOutput)
+        length = strip_delimiters(buffer, length, connection);
+    write_fully(1, buffer, length);
 }
 
 static void DeviceNotificationCallback(am_device_notification_callback_info *info, void *unknown)
@@ -216,21 +2211,29 @@ static void DeviceNotificationCallback(am_device_notification_callback_info *inf
                     if (AMDeviceStartSession(device) == MDERR_OK) {
                         service_conn_t connection;
                         if (AMDeviceStartService(device, AMSVC_SYSLOG_RELAY, &connection, NULL) == MDERR_OK) {
-                            CFSocketRef socket = CFSocketCreateWithNative(kCFAllocatorDefault, connection, kCFSocketDataCallBack, SocketCallback, NULL);
+                            DeviceConsoleConnection *data = malloc(sizeof *data);
+                            CFSocketContext context = { 0, data, NULL, NULL, NULL };
+                            data->lastByte = '\n';
+                            data->recordLength = 0;
+                            data->heldLength = 0;
+                            CFSocketRef socket = passthrough
+                                ? CFSocketCreateWithNative(kCFAllocatorDefault, connection, kCFSocketReadCallBack, PassthroughCallback, &context)
+                                : CFSocketCreateWithNative(kCFAllocatorDefault, connection, kCFSocketDataCallBack, SocketCallback, &context);
                             if (socket) {
                                 CFRunLoopSourceRef source = CFSocketCreateRunLoopSource(kCFAllocatorDefault, socket, 0);
                                 if (source) {
                                     CFRunLoopAddSource(CFRunLoopGetMain(), source, kCFRunLoopCommonModes);
                                     AMDeviceRetain(device);
-                                    DeviceConsoleConnection *data = malloc(sizeof *data);
                                     data->connection = connection;
                                     data->socket = socket;
                                     data->source = source;
+                                    data->recorder = recorderCapacity ? recorder_create(device) : NULL;
                                     CFDictionarySetValue(liveConnections, device, data);
                                     return;
                                 }
-                                CFRelease(source);
+                                CFRelease(socket);
                             }
+                            free(data);
                         }
                         AMDeviceStopSession(device);
                     }
@@ -254,6 +2257,8 @@ static void DeviceNotificationCallback(am_device_notification_callback_info *inf
                 CFRunLoopRemoveSource(CFRunLoopGetMain(), data->source, kCFRunLoopCommonModes);
                 CFRelease(data->source);
                 CFRelease(data->socket);
+                if (data->recorder)
+                    recorder_free(data->recorder);
                 free(data);
                 AMDeviceStopSession(device);
                 AMDeviceDisconnect(device);
@@ -265,31 +2270,79 @@ static void DeviceNotificationCallback(am_device_notification_callback_info *inf
     }
 }
 
-static void no_separator(int fd)
+static void no_separator(OutputBuffer *out)
 {
 }
 
-static void plain_separator(int fd)
+static void plain_separator(OutputBuffer *out)
 {
-    write_const(fd, "--\n");
+    append_const(out, "--\n");
 }
 
-static void color_separator(int fd)
+static void color_separator(OutputBuffer *out)
 {
-    write_const(fd, COLOR_DARK_WHITE "--" COLOR_RESET "\n");
+    append_const(out, COLOR_DARK_WHITE "--" COLOR_RESET "\n");
 }
 
 int main (int argc, char * const argv[])
 {
     if ((argc == 2) && (strcmp(argv[1], "--help") == 0)) {
-        fprintf(stderr, "Usage: %s [options]\nOptions:\n -d\t\t\tInclude connect/disconnect messages in standard out\n -u <udid>\t\tShow only logs from a specific device\n -p <process name>\tShow only logs from a specific process\n\nControl-C to disconnect\nMail bug reports and suggestions to <ryan.petrich@medialets.com>\n", argv[0]);
+        fprintf(stderr, "Usage: %s [options]\nOptions:\n"
+                " -d\t\t\tInclude connect/disconnect messages in standard out\n"
+                " -u <udid>\t\tShow only logs from a specific device\n"
+                " -p <process name>\tShow only logs from a specific process\n"
+                " -R <megabytes>\t\tKeep the most recent raw log of each device in a flight recorder ring\n"
+                " -T <text>\t\tDump the flight recorder when a log line contains text\n"
+                " -t <process>:<text>\tDump the flight recorder when a line from process contains text\n"
+                " -D <directory>\t\tWrite flight recorder dumps to directory (default .)\n"
+                " -l <lines/sec>\t\tRate limit each process to a number of lines per second (errors always shown)\n"
+                " -m <level>=<percent>\tShow only a percentage of lines at a level, such as Debug=1\n"
+                " -f <host:port|path>\tForward logs as RFC 5424 syslog over TCP or a unix socket instead of printing\n"
+                " -F <octet|lf>\t\tFrame forwarded records by octet counting (default) or newlines\n"
+                " -b <megabytes>\t\tBuffer up to this much unsent forwarded data (default 8)\n"
+                " -O <path>\t\tSpill forwarded data that doesn't fit in the buffer to a file\n"
+                " --format <template>\tPrint each line using a template of %%time, %%device, %%proc, %%pid, %%level and %%msg;\n"
+                "\t\t\tfields take printf-style widths, such as %%-20proc or %%.200msg\n"
+                " --mine\t\t\tGroup messages into templates as they arrive\n"
+                " --template-capture <path>\tWrite mined templates and each record's variables to a file (implies --mine)\n"
+                " --top <seconds>\tPeriodically print the most frequent templates to standard error (implies --mine)\n"
+                " --live\t\t\tOn a terminal, draw at a fixed frame rate and show only the newest lines when they arrive too fast\n"
+                " --fps <frames>\t\tFrames per second for --live (default 30)\n"
+                " --tee <path>\t\tAlso write every printed line, uncolored, to a file\n"
+                " --input <path>\t\tFilter and print a raw capture file, such as a flight recorder dump, and exit;\n"
+                "\t\t\tapplies -p, --format and the color options\n"
+                " --jobs <threads>\tWorker threads for --input (default one per core)\n"
+                " --raw\t\t\tCopy the relay's bytes to standard out untouched, NUL delimiters included\n"
+                " -S <path>\t\tListen for commands (dump, stats, top) on a unix socket\n"
+                "\nSend SIGUSR2 to dump the flight recorders\n"
+                "Control-C to disconnect\nMail bug reports and suggestions to <ryan.petrich@medialets.com>\n", argv[0]);
         return 1;
     }
     int c;
     bool use_separators = false;
     bool force_color = false;
+    const char *controlSocketPath = NULL;
+    const char *templateCapturePath = NULL;
+    double topInterval = 0;
+    double framesPerSecond = 30;
+    const char *teePath = NULL;
+    const char *inputPath = NULL;
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    static const struct option longOptions[] = {
+        { "format", required_argument, NULL, OptionFormat },
+        { "mine", no_argument, NULL, OptionMine },
+        { "template-capture", required_argument, NULL, OptionTemplateCapture },
+        { "top", required_argument, NULL, OptionTop },
+        { "live", no_argument, NULL, OptionLive },
+        { "fps", required_argument, NULL, OptionFps },
+        { "tee", required_argument, NULL, OptionTee },
+        { "input", required_argument, NULL, OptionInput },
+        { "jobs", required_argument, NULL, OptionJobs },
+        { "raw", no_argument, NULL, OptionRaw },
+        { NULL, 0, NULL, 0 }
+    };
 
-    while ((c = getopt(argc, argv, "dcsu:p:")) != -1)
+    while ((c = getopt_long(argc, argv, "dcsu:p:R:T:t:D:S:l:m:f:F:b:O:", longOptions, NULL)) != -1)
         switch (c)
     {
         case 'd':
@@ -312,8 +2365,104 @@ int main (int argc, char * const argv[])
 
             strcpy(requiredProcessName, optarg);
             break;
+        case 'R':
+            recorderCapacity = strtoul(optarg, NULL, 10) * 1024 * 1024;
+            break;
+        case 'T':
+            add_recorder_trigger(NULL, optarg);
+            break;
+        case 't':
+            if (!add_process_recorder_trigger(optarg)) {
+                fprintf(stderr, "Invalid trigger `%s'; expected <process>:<text>.\n", optarg);
+                return 1;
+            }
+            break;
+        case 'D':
+            recorderDirectory = optarg;
+            break;
+        case 'S':
+            controlSocketPath = optarg;
+            break;
+        case 'l': {
+            char *end;
+            rateLimit = strtod(optarg, &end);
+            if (end == optarg || *end != '\0' || !(rateLimit > 0)) {
+                fprintf(stderr, "Invalid rate limit `%s'; expected a positive number of lines per second.\n", optarg);
+                return 1;
+            }
+            rateBurst = rateLimit > 1 ? rateLimit : 1;
+            limitingEnabled = true;
+            break;
+        }
+        case 'm':
+            if (!set_sample_rate(optarg)) {
+                fprintf(stderr, "Invalid sample rate `%s'; expected Debug, Info, Notice, Warning or Unknown=<percent>.\n", optarg);
+                return 1;
+            }
+            limitingEnabled = true;
+            break;
+        case 'f':
+            forwarder.destination = optarg;
+            break;
+        case 'F':
+            if (strcmp(optarg, "lf") == 0) {
+                forwarder.lineFraming = true;
+            } else if (strcmp(optarg, "octet") != 0) {
+                fprintf(stderr, "Unknown framing `%s'; expected octet or lf.\n", optarg);
+                return 1;
+            }
+            break;
+        case 'b':
+            forwarder.retryLimit = strtoul(optarg, NULL, 10) * 1024 * 1024;
+            if (!forwarder.retryLimit)
+                forwarder.retryLimit = FORWARD_BATCH_SIZE;
+            break;
+        case 'O':
+            forwarder.spillPath = optarg;
+            break;
+        case OptionFormat:
+            if (!compile_format(optarg))
+                return 1;
+            break;
+        case OptionMine:
+            miningEnabled = true;
+            break;
+        case OptionTemplateCapture:
+            templateCapturePath = optarg;
+            miningEnabled = true;
+            break;
+        case OptionTop:
+            topInterval = strtod(optarg, NULL);
+            miningEnabled = true;
+            break;
+        case OptionLive:
+            live.enabled = true;
+            break;
+        case OptionFps:
+            framesPerSecond = strtod(optarg, NULL);
+            if (framesPerSecond <= 0)
+                framesPerSecond = 30;
+            break;
+        case OptionTee:
+            teePath = optarg;
+            break;
+        case OptionInput:
+            inputPath = optarg;
+            break;
+        case OptionJobs:
+            jobs = strtol(optarg, NULL, 10);
+            break;
+        case OptionRaw:
+            rawOutput = true;
+            break;
         case '?':
-            if (optopt == 'u')
+            if (optopt == 0) {
+                fprintf(stderr, "Unknown option `%s'.\n", argv[optind - 1]);
+            } else if (optopt >= OptionFormat) {
+                for (const struct option *option = longOptions; option->name; option++)
+                    if (option->val == optopt)
+                        fprintf(stderr, "Option --%s requires an argument.\n", option->name);
+            } else if (strchr("upRTtDSlmfFbO", optopt))
                 fprintf(stderr, "Option -%c requires an argument.\n", optopt);
             else if (isprint(optopt))
                 fprintf(stderr, "Unknown option `-%c'.\n", optopt);
@@ -323,13 +2472,79 @@ int main (int argc, char * const argv[])
         default:
             abort();
     }
-    if (force_color || isatty(1)) {
+    if (inputPath && forwarder.destination) {
+        fprintf(stderr, "Option --input can't be combined with -f.\n");
+        return 1;
+    }
+    if (forwarder.destination) {
+        printMessage = &forward_message;
+        printSeparator = &no_separator;
+        if (!forwarder_resolve())
+            return 1;
+        if (!start_forwarder()) {
+            fprintf(stderr, "deviceconsole: unable to open %s: %s\n", forwarder.spillPath, strerror(errno));
+            return 1;
+        }
+    } else if (formatOpCount) {
+        printMessage = &write_formatted;
+        printSeparator = use_separators ? &plain_separator : &no_separator;
+    } else if (!rawOutput && (force_color || isatty(1))) {
         printMessage = &write_colored;
         printSeparator = use_separators ? &color_separator : &no_separator;
     } else {
-        printMessage = &write_fully;
+        printMessage = &buffer_append;
         printSeparator = use_separators ? &plain_separator : &no_separator;
     }
+    if (inputPath)
+        return process_capture_file(inputPath, jobs);
+    if (recorderTriggerCount && !recorderCapacity) {
+        fprintf(stderr, "Options -T and -t require a flight recorder size (-R).\n");
+        return 1;
+    }
+    if (recorderCapacity && !install_dump_signal()) {
+        perror("deviceconsole: unable to install SIGUSR2 handler");
+        return 1;
+    }
+    if (controlSocketPath && !listen_on_control_socket(controlSocketPath)) {
+        fprintf(stderr, "deviceconsole: unable to listen on %s: %s\n", controlSocketPath, strerror(errno));
+        return 1;
+    }
+    // The live view only makes sense when a terminal is what's being drawn to
+    live.enabled = live.enabled && !forwarder.destination && isatty(1);
+    if (live.enabled)
+        start_live_view(framesPerSecond);
+    if (teePath) {
+        teeFd = open(teePath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (teeFd == -1) {
+            fprintf(stderr, "deviceconsole: unable to open %s: %s\n", teePath, strerror(errno));
+            return 1;
+        }
+        teeMessage = formatOpCount ? &write_formatted : &buffer_append;
+    }
+    if (templateCapturePath) {
+        miner.captureFd = open(templateCapturePath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (miner.captureFd == -1) {
+            fprintf(stderr, "deviceconsole: unable to open %s: %s\n", templateCapturePath, strerror(errno));
+            return 1;
+        }
+    }
+    if (topInterval > 0) {
+        CFRunLoopTimerRef timer = CFRunLoopTimerCreate(kCFAllocatorDefault, CFAbsoluteTimeGetCurrent() + topInterval, topInterval, 0, 0, TopTemplatesCallback, NULL);
+        CFRunLoopAddTimer(CFRunLoopGetMain(), timer, kCFRunLoopCommonModes);
+        CFRelease(timer);
+    }
+    if (limitingEnabled) {
+        CFRunLoopTimerRef timer = CFRunLoopTimerCreate(kCFAllocatorDefault, CFAbsoluteTimeGetCurrent() + SUPPRESSION_REPORT_INTERVAL, SUPPRESSION_REPORT_INTERVAL, 0, 0, SuppressionReportCallback, NULL);
+        CFRunLoopAddTimer(CFRunLoopGetMain(), timer, kCFRunLoopCommonModes);
+        CFRelease(timer);
+    }
+    // Plain unfiltered output doesn't need to see individual records
+    passthrough = !requiredProcessName && printMessage == &buffer_append && printSeparator == &no_separator
+        && !limitingEnabled && !recorderCapacity && !miningEnabled && !live.enabled && teeFd == -1;
+    if (rawOutput && !passthrough) {
+        fprintf(stderr, "Option --raw can't be combined with filtering, formatting, separators, recording or forwarding.\n");
+        return 1;
+    }
     liveConnections = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, NULL, NULL);
     am_device_notification *notification;
     AMDeviceNotificationSubscribe(DeviceNotificationCallback, 0, 0, NULL, &notification);